@@ -1,12 +1,18 @@
 #include "../virtual machine/parser.c"
-#define INPUT_LIMIT 1000
 
 char* start_up_info="";
 
-int main()
+/* 
+    runs the file given as the first argument (parsed on the number of 
+    threads given as the second or compiled ahead of time if it's aot) 
+    otherwise the eval_loop on stdin
+*/
+int main(int argc, char** argv)
 {
-    char input[INPUT_LIMIT];
-    printf("%s\n>>> ",start_up_info);
-    eval_loop(input,INPUT_LIMIT);
+    if (argc > 2 && strcmp(argv[2],"aot")==0){eval_aot(argv[1]);return 0;}
+    if (argc > 2){eval_script(argv[1],atoi(argv[2]));return 0;}
+    if (argc > 1){eval_file(argv[1]);return 0;}
+    printf("%s\n",start_up_info);
+    eval_loop(stdin);
     return 0;
 }
\ No newline at end of file
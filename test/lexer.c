@@ -1,15 +1,19 @@
 #include "../virtual machine/lexer.c"
 #define INPUT_LIMIT 1000
 
+void print_token(TokenType* token)
+{
+    if (token->type==TOKEN_WHITESPACE)
+    {printf("TOKEN(%d,%*s)\n", token->type, token->length,"");}
+    else{printf("TOKEN(%d,%s)\n", token->type, token_value(token));}
+}
 /* prints the tokens as they come */
 int token_print(LexerType* lexer)
 {
     TokenType* token=next_token(lexer);
     while (token->type!=TOKEN_EOF && token->type!=TOKEN_ERROR)
     {
-        if (token->type==TOKEN_WHITESPACE)
-        {printf("TOKEN(%d,%*s)\n", token->type, strlen(token->value),"");}
-        else{printf("TOKEN(%d,%s)\n", token->type, token->value);}
+        print_token(token);
         token=next_token(lexer);
     }
     // for the EOF
@@ -20,13 +24,29 @@ int token_print(LexerType* lexer)
 
 char* start_up_info="";
 
-int main()
+int main(int argc, char** argv)
 {
+    // lexes the file given as the first argument (i.e. for timing large files)
+    if (argc > 1)
+    {
+        LexerType* lexer = lexer_init_file(argv[1]);
+        if (lexer == NULL){printf("Error: Could not open the file '%s'\n",argv[1]);return 1;}
+        TokenType* token=next_token(lexer);
+        while (token->type!=TOKEN_EOF && token->type!=TOKEN_ERROR)
+        {
+            print_token(token);
+            arena_reset(&unit_arena); // so the file is lexed in constant memory
+            token=next_token(lexer);
+        }
+        lexer_free(lexer);
+        return 0;
+    }
     char input[INPUT_LIMIT];
     printf("%s\n>>> ",start_up_info);
     LexerType* lexer;
     while (fgets(input, INPUT_LIMIT, stdin))
     {
+        arena_reset(&unit_arena);
         lexer = lexer_init(input);
         token_print(lexer);
         printf(">>> ");
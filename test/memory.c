@@ -4,9 +4,31 @@ int main()
 {
     globals=table_init();
     FrameType* frame = frame_init("test");
-    printf("%s\n", frame->frame_name);
-    FrameType* temp_frame = table_get(globals, "test");
-    printf("frame_name: %s\n", frame->frame_name);
-    printf("frame_name: %s\n", temp_frame->frame_name);
+    printf("%s\n", symbol_name(frame->symbol));
+    // frames are on the frame stack rather than in the globals
+    printf("in globals: %s\n", table_get(globals, "test") ? "yes" : "no");
+    // a call frame with x and y in slots and z by name
+    LocalScope scope={0};
+    int x=local_slot(&scope, symbol_intern("x", 1)), y=local_slot(&scope, symbol_intern("y", 1));
+    CallFrame* call=frame_push(symbol_intern("call", 4), scope.count);
+    local_store(call, x, INT_VALUE(1));
+    local_store(call, y, INT_VALUE(2));
+    local_set(call, &scope, symbol_intern("z", 1), INT_VALUE(3));
+    printf("x: %lld, y: %lld, z: %lld\n", (long long)AS_INT(local_load(call, x)), (long long)AS_INT(local_lookup(call, &scope, symbol_intern("y", 1))), (long long)AS_INT(local_lookup(call, &scope, symbol_intern("z", 1))));
+    frames_command(NULL, 1);
+    // a string only the frame has is collected once it's popped
+    char* text="a string too long to be NaN-boxed";
+    local_store(call, x, string_object(text, strlen(text), OWNER_HEAP));
+    gc_collect();
+    gc_sweep(LLONG_MAX);
+    printf("objects: %lld\n", gc_object_count);
+    frame_pop();
+    free_frame(frame);
+    frames_command(NULL, 1);
+    gc_collect();
+    gc_sweep(LLONG_MAX);
+    printf("objects: %lld, collections: %lld\n", gc_object_count, gc_collections);
+    scope_free(&scope);
+    slabs_command(NULL, 1);
     return 0;
 }
\ No newline at end of file
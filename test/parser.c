@@ -2,37 +2,28 @@
 #define INPUT_LIMIT 1000
 
 /*
-    collects the current form
+    collects the source code of the form
 */
-char* source_code(LexerType* lexer,int start_index)
+char* source_code(LexerType* lexer,FormType* form)
 {
-    /*
-        collect the string then print it
-    */
-    char* value = calloc(1, sizeof(char));
-    value[0] = '\0';
-    char* str;
-    for (int i=start_index; i < lexer->index; i++)
-    {
-        str = char_as_string(lexer->source[i]);
-        value = realloc(value, (strlen(value) + strlen(str) + 1) * sizeof(char));
-        strcat(value, str);
-    }
+    TokenBuffer* buffer=lexer->tokens;
+    int start=buffer->offsets[form->first_token];
+    int end=buffer->offsets[form->last_token]+buffer->lengths[form->last_token];
+    char* value = calloc(end - start + 1, sizeof(char));
+    memcpy(value, lexer->source + start, end - start);
     return value;
 }
 
 #define print_form(num,str) printf("FORM(%d,%s)\n",num,str)
-#define default_print print_form(form->type,source_code(lexer,index))
+#define default_print print_form(form->type,source_code(lexer,form))
 /*
     Parses tokens into forms that can converted into executable forms
 */
 void parse(LexerType* lexer)
 {
     FormType* form;
-    int index;
-    while (lexer_isrunning(lexer))
+    while (parser_isrunning(lexer))
     {
-        index=lexer->index; // used in default_print
         form = next_form(lexer);
         if (form->type==SYNTAX_ERROR){default_print;return;}
         if (form->type==TOKEN_NEWLINE){print_form(TOKEN_NEWLINE,"\\n");return;}
@@ -50,6 +41,7 @@ int main()
     LexerType* lexer;
     while (fgets(input, INPUT_LIMIT, stdin))
     {
+        arena_reset(&unit_arena);
         lexer = lexer_init(input);
         parse(lexer); // is the only line that differs from test/lexer.c and this file
         printf(">>> ");
@@ -10,8 +10,8 @@
 
     The evaluator should perform typically the following operations among other things:
 
-    1. Load from or into memory     - everything is stored as a string, in frames or in the global scope, scope names are separated by spaces
-    2. Perform operations on memory - operations are performed on strings basically
+    1. Load from or into memory     - everything is stored as a Value (see memory.c), in frames or in the global scope, scope names are separated by spaces
+    2. Perform operations on memory - numbers are operated on directly and strings are concatenated
     3. Free memory                  - simply free it or free its contents as well
 
     4. Print to display
@@ -31,9 +31,11 @@ typedef struct TYPE_STRUCT
 /********************************************
 * Internal functions used to evaluate forms *
 ********************************************/
-void print(char* key)
+Value print(Value value)
 {
-    printf("To be implemented\n");
+    char buffer[32];
+    printf("%s\n",value_string(value,buffer,sizeof(buffer)));
+    return value;
 }
 
 // void bin_op(FormType* form)
@@ -63,36 +65,818 @@ void add_metadata(FormType* form)
 }
 
 
+/********************************************
+*                 Bytecode                  *
+********************************************/
+/*
+    The instructions of a statements forms are compiled into bytecode
+    as soon as it's parsed (while its tokens are still around) so
+    evaluating it is just running through an array of ints.
+
+    Each instruction is an int with the opcode in its lowest 8 bits
+    and its operand (a constant, symbol, operator or external) above them.
+
+    The instructions of a form take its partial form in order:
+     - LOAD   pushes the next value (an id, number, string, const or the abstract forms result)
+     - BIN_OP operates on the last value and the next one with the next operator
+     - STORE  stores the value the form leaves at the next id
+     - DELETE deletes the next id
+     - EXT    calls the external of the next id (i.e. print) on the value the form leaves
+
+    i.e. \-grammar add form 7,10,8 2000,2001 makes x=1 store 1 at x
+
+    An abstract form is compiled in where its value is loaded (or before
+    the form if it isn't) and how deep the stack gets is worked out here
+    so the evaluator doesn't have to check.
+
+    The optimization passes (see PASSES in utils.c) are run over it and
+    then the hottest sequences of instructions are fused into superinstructions
+    (see SUPERINSTRUCTIONS in utils.c) by rewriting the first opcode of the
+    sequence so the operands of the rest are still where they were.
+
+    Constants are made into values as they're compiled (see constant_value)
+    so CONST only has to push them and LOAD and STORE remember where their 
+    symbol is in the globals (see InlineCache in memory.c).
+
+    Note: everything is stored in the globals for now.
+*/
+#define OPCODE(instruction) ((instruction) & 0xff)
+#define OPERAND(instruction) ((instruction) >> 8)
+#define INSTRUCTION(opcode,operand) ((opcode) | (operand) << 8)
+#define MAX_OPERAND (1 << 23)
+#define END_FORM_BITS 10 // the OP_END operand is the form then the JIT entry + 1 (0 until it's looked up)
+#define END_FORM(operand) ((operand) & ((1 << END_FORM_BITS)-1))
+#define END_ENTRY(operand) ((operand) >> END_FORM_BITS)
+#if MAX_FORM_ITEMS >= 1 << END_FORM_BITS
+#error "END_FORM_BITS is too small for MAX_FORM_ITEMS"
+#endif
+#define EVAL_STACK_SIZE 256
+
+typedef struct CODE_STRUCT
+{
+    int* code;
+    InlineCache* caches; // one for each instruction (only LOAD and STORE use theirs)
+    int length;
+    int capacity;
+    int* constants; // where each constant starts in the pool
+    int* types; // each constants token type
+    Value* values; // each constant as a value
+    int constant_count;
+    int constant_capacity;
+    char* pool;
+    int pool_length;
+    int pool_capacity;
+} CodeType;
+CodeType unit_code; // the current statement
+
+char* operators[]={"+","-","*","/","%","<",">",NULL};
+char* external_names[]={"print",NULL};
+Value (*externals[])(Value)={print};
+
+typedef struct COMPILER_STRUCT
+{
+    FormStream* stream;
+    TokenBuffer* buffer;
+    CodeType* code;
+    int depth;
+    int error;
+} CompilerType;
+
+/* the constants that are objects belong to the code */
+void code_clear(CodeType* code)
+{
+    for (int i = 0; i < code->constant_count; i++){if (IS_OBJECT(code->values[i])){free(AS_OBJECT(code->values[i]));}}
+    code->length=0;code->constant_count=0;code->pool_length=0;
+}
+void code_free(CodeType* code)
+{
+    code_clear(code);
+    free(code->code);free(code->caches);free(code->constants);free(code->types);free(code->values);free(code->pool);
+    memset(code,0,sizeof(CodeType));
+}
+void emit(CodeType* code, int opcode, int operand)
+{
+    if (code->length==code->capacity)
+    {
+        code->capacity = code->capacity ? code->capacity*2 : 64;
+        code->code = realloc(code->code, code->capacity*sizeof(int));
+        code->caches = realloc(code->caches, code->capacity*sizeof(InlineCache));
+    }
+    code->caches[code->length]=(InlineCache){NULL,0}; // unit_code reuses the same places for other symbols
+    code->code[code->length++]=INSTRUCTION(opcode,operand);
+}
+/* copies the value into the pool (so the code outlives the tokens) and makes it a Value */
+int code_constant(CodeType* code, char* value, int type)
+{
+    int length=strlen(value)+1;
+    if (code->constant_count==code->constant_capacity)
+    {
+        code->constant_capacity = code->constant_capacity ? code->constant_capacity*2 : 16;
+        code->constants = realloc(code->constants, code->constant_capacity*sizeof(int));
+        code->types = realloc(code->types, code->constant_capacity*sizeof(int));
+        code->values = realloc(code->values, code->constant_capacity*sizeof(Value));
+    }
+    while (code->pool_length+length > code->pool_capacity)
+    {
+        code->pool_capacity = code->pool_capacity ? code->pool_capacity*2 : 256;
+        code->pool = realloc(code->pool, code->pool_capacity);
+    }
+    memcpy(code->pool+code->pool_length, value, length);
+    code->constants[code->constant_count]=code->pool_length;
+    code->types[code->constant_count]=type;
+    code->values[code->constant_count]=constant_value(value,type,OWNER_CODE);
+    code->pool_length+=length;
+    return code->constant_count++;
+}
+int find_name(char** names, char* name)
+{
+    for (int i = 0; names[i]; i++){if (strcmp(names[i],name)==0){return i;}}
+    return -1;
+}
 
-void eval(FormType* form)
+/* 
+    compile errors are printed unless they're being collected (i.e. by a 
+    chunk parsed on another thread so they come out when it's evaluated)
+*/
+typedef struct DIAGNOSTICS_STRUCT
 {
-    /*
-        all an abstract form should do is require prior evaluations 
-        to be done before the current form is evaluated.
+    char* text;
+    int length;
+    int capacity;
+} Diagnostics;
+__thread Diagnostics* compile_diagnostics;
 
-        The FORMS will make use of the abstract forms partial form
-    */
-    if (form->abstract_form){eval(form->abstract_form);}
-    /* go through the instructions */
-    int* instructions=EXEC_FORMS[form->type];
-    for (int i = 0; i < int_len(instructions); i++)
+void compile_error(char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    Diagnostics* diagnostics=compile_diagnostics;
+    if (diagnostics==NULL){vprintf(format, args);va_end(args);return;}
+    va_list copy;
+    va_copy(copy, args);
+    int length=vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (diagnostics->length+length+1 > diagnostics->capacity)
+    {
+        diagnostics->capacity=(diagnostics->length+length+1)*2;
+        diagnostics->text=realloc(diagnostics->text, diagnostics->capacity);
+    }
+    vsnprintf(diagnostics->text+diagnostics->length, length+1, format, args);
+    diagnostics->length+=length;
+    va_end(args);
+}
+#define COMPILE_ERROR(...) {compile_error("Compile Error: " __VA_ARGS__);compiler->error=1;return -1;}
+#define SLOT_VALUE 0
+#define SLOT_ID 1
+#define SLOT_OPERATOR 2
+/*
+    returns the next token in the form from the cursor on that's of the kind
+    (moving the cursor past it) or the abstract forms first token for a value
+*/
+int next_slot(CompilerType* compiler, FormRecord* form, FormRecord* abstract, int* cursor, int kind)
+{
+    int end=form->first_token+form->tokens;
+    while (*cursor < end)
+    {
+        int slot=(*cursor)++;
+        if (abstract && slot==abstract->first_token)
+        {
+            *cursor=slot+abstract->tokens;
+            if (kind==SLOT_VALUE){return slot;}
+            continue;
+        }
+        int type=compiler->buffer->types[slot];
+        if (type==TOKEN_ID && kind!=SLOT_OPERATOR){return slot;}
+        if ((type==TOKEN_NUMBER || type==TOKEN_STRING || type==TOKEN_CONST) && kind==SLOT_VALUE){return slot;}
+        if ((type==TOKEN_OPERATOR || type >= TOKEN_BACKTICK) && kind==SLOT_OPERATOR){return slot;}
+    }
+    COMPILE_ERROR("Form %d has no %s left for its instructions\n",form->type,kind==SLOT_ID ? "id" : kind==SLOT_OPERATOR ? "operator" : "value")
+}
+int symbol_operand(CompilerType* compiler, int slot)
+{
+    int symbol=compiler->buffer->symbols[slot];
+    if (symbol >= MAX_OPERAND){COMPILE_ERROR("Too many symbols\n")}
+    return symbol;
+}
+void compile_form(CompilerType* compiler, int record);
+/* pushes the value at the slot */
+void compile_value(CompilerType* compiler, int record, int slot)
+{
+    FormRecord* form=&compiler->stream->records[record];
+    if (form->children && slot==compiler->stream->records[record-1].first_token){compile_form(compiler,record-1);return;}
+    int symbol;
+    if (compiler->buffer->types[slot]==TOKEN_ID)
     {
-        /* might make this an array or a hash table for it to be more dynamic for the user */
+        if ((symbol=symbol_operand(compiler,slot))!=-1){emit(compiler->code,OP_LOAD,symbol);}
+    }
+    else{emit(compiler->code,OP_CONST,code_constant(compiler->code,token_value(compiler->buffer->tokens[slot]),compiler->buffer->types[slot]));}
+    compiler->depth++;
+}
+/* compiles the records instructions (and its abstract forms) */
+void compile_form(CompilerType* compiler, int record)
+{
+    FormRecord* form=&compiler->stream->records[record];
+    if (form->type < 0 || compiler->error){return;} // newlines, line continuations and syntax errors have nothing to execute
+    FormRecord* abstract = form->children ? &compiler->stream->records[record-1] : NULL;
+    CodeType* code=compiler->code;
+    int start=code->length, base=compiler->depth, cursor=form->first_token;
+    int deferred[MAX_FORM_SIZE], deferred_count=0, used=0;
+    int* instructions=compiler->stream->grammar->exec_forms[form->type];
+    for (int i = 0; i < MAX_FORM_SIZE && instructions[i] && !compiler->error; i++)
+    {
+        int slot, operand;
         switch (instructions[i])
         {
-            case STORE:
-                break;
             case LOAD:
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_VALUE))==-1){break;}
+                used|=abstract && slot==abstract->first_token;
+                compile_value(compiler,record,slot);
                 break;
             case BIN_OP:
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_OPERATOR))==-1){break;}
+                operand=find_name(operators,token_value(compiler->buffer->tokens[slot]));
+                if (operand==-1){compile_error("Compile Error: Unsupported operator '%s'\n",token_value(compiler->buffer->tokens[slot]));compiler->error=1;break;}
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_VALUE))==-1){break;}
+                used|=abstract && slot==abstract->first_token;
+                compile_value(compiler,record,slot);
+                if (compiler->depth-base < 2){compile_error("Compile Error: Form %d has nothing to BIN_OP on\n",form->type);compiler->error=1;break;}
+                emit(code,OP_BIN_OP,operand);
+                compiler->depth--;
+                break;
+            case STORE:
+                // what the form leaves is stored once it's done
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_ID))!=-1 && (operand=symbol_operand(compiler,slot))!=-1)
+                {deferred[deferred_count++]=INSTRUCTION(OP_STORE,operand);}
                 break;
             case DELETE:
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_ID))!=-1 && (operand=symbol_operand(compiler,slot))!=-1)
+                {emit(code,OP_DELETE,operand);}
                 break;
             case EXT:
+                if ((slot=next_slot(compiler,form,abstract,&cursor,SLOT_ID))==-1){break;}
+                operand=find_name(external_names,token_value(compiler->buffer->tokens[slot]));
+                if (operand==-1){compile_error("Compile Error: There is no external '%s'\n",token_value(compiler->buffer->tokens[slot]));compiler->error=1;break;}
+                deferred[deferred_count++]=INSTRUCTION(OP_EXT,operand);
                 break;
             default:
-                printf("Instruction Error: Invalid instruction: %d\n",instructions[i]);
-                return;
+                compile_error("Instruction Error: Invalid instruction: %d\n",instructions[i]);
+                compiler->error=1;
+        }
+    }
+    if (compiler->error){return;}
+    // the last one deferred is the first one done (i.e. print(x=1) stores then prints)
+    while (deferred_count--)
+    {
+        if (compiler->depth==base){compile_error("Compile Error: Form %d has no value to %s\n",form->type,OPCODE(deferred[deferred_count])==OP_STORE ? "STORE" : "EXT");compiler->error=1;return;}
+        emit(code,OPCODE(deferred[deferred_count]),OPERAND(deferred[deferred_count]));
+    }
+    // the abstract form still has to be done first if its value wasn't used
+    if (abstract && !used)
+    {
+        int length=code->length-start;
+        int* temp=malloc(length*sizeof(int));
+        memcpy(temp, code->code+start, length*sizeof(int));
+        code->length=start;
+        compile_form(compiler,record-1);
+        for (int i = 0; i < length; i++){emit(code,OPCODE(temp[i]),OPERAND(temp[i]));}
+        free(temp);
+    }
+    if (compiler->depth >= EVAL_STACK_SIZE){compile_error("Compile Error: The statement is too deep to evaluate\n");compiler->error=1;}
+}
+/* replaces the first opcode of each sequence that has a superinstruction being used */
+void fuse(CodeType* code, int start)
+{
+    int* used[len(SUPERINSTRUCTIONS)];
+    int count=0;
+    for (int i = 0; SUPERINSTRUCTIONS[i][0]; i++){if (fused[SUPERINSTRUCTIONS[i][0]]){used[count++]=SUPERINSTRUCTIONS[i];}}
+    if (count==0){return;}
+    int* ip=code->code+start;
+    while (OPCODE(*ip)!=OP_END)
+    {
+        int length=1;
+        for (int i = 0; i < count; i++)
+        {
+            int* sequence=used[i];
+            int n=1;
+            // the OP_END stops it from going past the statement
+            while (n < 4 && sequence[n] && OPCODE(ip[n-1])==sequence[n]){n++;}
+            if (n < 4 && sequence[n]){continue;}
+            *ip=INSTRUCTION(sequence[0],OPERAND(*ip));
+            length=n-1;
+            break;
+        }
+        ip+=length;
+    }
+}
+void optimize(CodeType* code, int start);
+/*
+    compiles the statement in the stream onto the end of the code
+    (from the tokens it was parsed from) returning where it starts
+*/
+int compile_statement(FormStream* stream, TokenBuffer* buffer, CodeType* code)
+{
+    unsigned long long began = profiling ? profile_clock() : 0;
+    int start=code->length;
+    CompilerType compiler={stream,buffer,code,0,0};
+    if (stream->count){compile_form(&compiler,stream->count-1);}
+    if (compiler.error){code->length=start;}
+    // the OP_END has the statements form for the profiler (and its JIT entry once it's evaluated)
+    int form = stream->count && !compiler.error && stream->records[stream->count-1].type >= 0 ? stream->records[stream->count-1].type : MAX_FORM_ITEMS;
+    emit(code,OP_END,form);
+    optimize(code,start);
+    fuse(code,start);
+    if (began){profile_add(&profile_phases[PHASE_COMPILE],profile_clock()-began);}
+    return start;
+}
+/*
+    operations on values (numbers if they both are, otherwise + concatenates them as strings)
+
+    Two ints are the fast path (int_op) that's tried first, it gives up 
+    (returns 0) on division or if the result doesn't fit in 48 bits and 
+    bin_op does it with doubles instead (and fails on a zero divisor).
+
+    Note: strings made are in the unit_arena
+*/
+static inline int int_op(int operator, int64_t a, int64_t b, Value* result)
+{
+    int64_t value;
+    switch (operator)
+    {
+        case 0: value=a+b; break;
+        case 1: value=a-b; break;
+        case 2:
+            // 48 bits times 48 bits can overflow 64
+            if ((double)a*b > INT_MAX48 || (double)a*b < INT_MIN48){return 0;}
+            value=a*b;
+            break;
+        case 4: if (b==0){return 0;} value=a%b; break;
+        case 5: *result=BOOL_VALUE(a<b); return 1;
+        case 6: *result=BOOL_VALUE(a>b); return 1;
+        default: return 0;
+    }
+    if (value < INT_MIN48 || value > INT_MAX48){return 0;}
+    *result=INT_VALUE(value);
+    return 1;
+}
+int is_number(Value value){return IS_INT(value) || IS_DOUBLE(value);}
+Value bin_op(int operator, Value left, Value right)
+{
+    if (is_number(left) && is_number(right))
+    {
+        double a=as_double(left), b=as_double(right);
+        switch (operator)
+        {
+            case 0: return double_value(a+b);
+            case 1: return double_value(a-b);
+            case 2: return double_value(a*b);
+            case 3: case 4:
+                if (b==0){printf("Zero Division Error: '%s' by zero\n",operators[operator]);return UNDEFINED;}
+                return double_value(operator==3 ? a/b : fmod(a,b));
+            case 5: return BOOL_VALUE(a<b);
+            default: return BOOL_VALUE(a>b);
+        }
+    }
+    char left_buffer[32], right_buffer[32];
+    char* a=value_string(left,left_buffer,sizeof(left_buffer)), *b=value_string(right,right_buffer,sizeof(right_buffer));
+    if (operator!=0){printf("Type Error: '%s' needs numbers but got '%s' and '%s'\n",operators[operator],a,b);return UNDEFINED;}
+    int left_length=strlen(a), right_length=strlen(b);
+    Value value=string_object(NULL, left_length+right_length, OWNER_ARENA);
+    memcpy(AS_STRING(value)->chars, a, left_length);
+    memcpy(AS_STRING(value)->chars+left_length, b, right_length);
+    return value;
+}
+/********************************************
+*           Optimization passes             *
+********************************************/
+/*
+    Each pass (see PASSES in utils.c) goes over the statement as it's 
+    compiled, compacting it in place, and returns how many instructions 
+    it removed (and adds how many it replaced with another to rewritten). 
+    They only see one statement so they never assume 
+    anything about what's in the globals before it.
+*/
+/* adds the value as a constant (the text is what eval_aot writes out) */
+int code_value(CodeType* code, Value value)
+{
+    char buffer[32];
+    int type=TOKEN_NUMBER;
+    switch (VALUE_TAG(value))
+    {
+        case TAG_DOUBLE: snprintf(buffer, sizeof(buffer), "%.17g", as_double(value)); break;
+        case TAG_INT: snprintf(buffer, sizeof(buffer), "%lld", (long long)AS_INT(value)); break;
+        case TAG_BOOL: case TAG_NONE: type=TOKEN_CONST; break;
+        default: type=TOKEN_STRING;
+    }
+    int constant=code_constant(code, type==TOKEN_NUMBER ? buffer : value_string(value,buffer,sizeof(buffer)), type);
+    if (type!=TOKEN_STRING){code->values[constant]=value;} // i.e. so a whole double stays a double
+    return constant;
+}
+/* BIN_OPs of two constants become the constant they make (which can be folded again) */
+int fold(CodeType* code, int start, int* rewritten)
+{
+    int* in=code->code+start, *out=in;
+    for (; OPCODE(*in)!=OP_END; in++)
+    {
+        *out++=*in;
+        if (OPCODE(*in)!=OP_BIN_OP || out-(code->code+start) < 3 || OPCODE(out[-3])!=OP_CONST || OPCODE(out[-2])!=OP_CONST){continue;}
+        Value left=code->values[OPERAND(out[-3])], right=code->values[OPERAND(out[-2])], value;
+        int operator=OPERAND(*in);
+        if (!(IS_INT(left) && IS_INT(right) && int_op(operator,AS_INT(left),AS_INT(right),&value)))
+        {
+            // it's left for the Type Error or Zero Division Error when it's evaluated
+            if (!(is_number(left) && is_number(right)) && operator!=0){continue;}
+            if ((operator==3 || operator==4) && is_number(right) && as_double(right)==0){continue;}
+            value=bin_op(operator,left,right);
+        }
+        out-=3;
+        *out++=INSTRUCTION(OP_CONST,code_value(code,value));
+        (*rewritten)++;
+    }
+    *out=*in;
+    return in-out;
+}
+/* a LOAD of the id just stored is the value the STORE left on the stack */
+int forward(CodeType* code, int start, int* rewritten)
+{
+    for (int* ip = code->code+start; OPCODE(*ip)!=OP_END; ip++)
+    {
+        if (OPCODE(*ip)==OP_STORE && OPCODE(ip[1])==OP_LOAD && OPERAND(ip[1])==OPERAND(*ip)){ip[1]=INSTRUCTION(OP_DUP,0);(*rewritten)++;}
+    }
+    return 0; // the LOAD's replaced rather than removed
+}
+/* 
+    a STORE is dead if its id is stored over or deleted before it's loaded 
+    and nothing in between can fail (that would leave what it stored)
+*/
+int dead_stores(CodeType* code, int start, int* rewritten)
+{
+    int* in=code->code+start, *out=in;
+    for (; OPCODE(*in)!=OP_END; in++)
+    {
+        if (OPCODE(*in)==OP_STORE)
+        {
+            int* next=in+1;
+            while (OPCODE(*next)==OP_CONST || OPCODE(*next)==OP_DUP || (OPCODE(*next)==OP_STORE && OPERAND(*next)!=OPERAND(*in))){next++;}
+            if ((OPCODE(*next)==OP_STORE || OPCODE(*next)==OP_DELETE) && OPERAND(*next)==OPERAND(*in)){continue;}
+        }
+        *out++=*in;
+    }
+    *out=*in;
+    return in-out;
+}
+int (*pass_functions[PASS_COUNT])(CodeType*, int, int*)={fold,forward,dead_stores};
+void optimize(CodeType* code, int start)
+{
+    for (int i = 0; i < PASS_COUNT; i++)
+    {
+        if (!passes[i]){continue;}
+        int rewritten=0, removed=pass_functions[i](code,start,&rewritten);
+        if (removed){atomic_fetch_add(&pass_removed[i],removed);}
+        if (rewritten){atomic_fetch_add(&pass_rewritten[i],rewritten);}
+    }
+    int* ip=code->code+start;
+    while (OPCODE(*ip)!=OP_END){ip++;}
+    code->length=ip-code->code+1;
+}
+/********************************************
+*                Evaluation                 *
+********************************************/
+/*
+    dispatches with computed gotos (one indirect jump per instruction)
+    when the compiler has them otherwise it's a switch in a loop
+*/
+#if defined(__GNUC__)
+#define DISPATCH_START DISPATCH;
+#define DISPATCH instruction=*ip++; goto *targets[OPCODE(instruction)]
+#define TARGET(opcode) label_##opcode:
+#else
+#define DISPATCH_START while (1) switch (OPCODE(instruction=*ip++))
+#define DISPATCH break
+#define TARGET(opcode) case opcode:
+#endif
+/*
+    counts the pairs and triples of opcodes in the statement (it's straight 
+    line code so they're the ones that are about to run) and picks the 
+    superinstructions once there's enough of them
+*/
+void fuse_profile(CodeType* code, int start)
+{
+    int a=OP_END, b=OP_END;
+    for (int* ip = code->code+start; OPCODE(*ip)!=OP_END; ip++)
+    {
+        int c=OPCODE(*ip);
+        // only the first opcode of a sequence is replaced
+        for (int i = 0; c >= BASE_OPCODES; i++){if (SUPERINSTRUCTIONS[i][0]==c){c=SUPERINSTRUCTIONS[i][1];}}
+        if (b!=OP_END)
+        {
+            pair_counts[b][c]++;
+            if (a!=OP_END){triple_counts[a][b][c]++;}
+        }
+        a=b;
+        b=c;
+    }
+    // the threads compiling eval_scripts chunks use the superinstructions they started with
+    if (++profiled >= FUSE_AFTER && !symbol_threads){fuse_select();}
+}
+/* what's stored is on the heap (where it's shared and the garbage collector frees it) */
+#define DO_CONST(operand) stack[top++]=code->values[operand];
+#define SITE(instruction) (code->caches+((instruction)-code->code)) // the instructions inline cache
+#define DO_LOAD(operand,cache) \
+value=load_cached(operand,cache); \
+if (value==UNDEFINED){printf("Name Error: '%s' is not defined\n",symbol_name(operand));EVAL_FAIL;} \
+stack[top++]=value;
+#define DO_STORE(operand,cache) stack[top-1]=value_promote(stack[top-1]); store_cached(operand,stack[top-1],cache);
+#define DO_BIN_OP(operand) \
+left=stack[top-2]; \
+right=stack[top-1]; \
+if (!(IS_INT(left) && IS_INT(right) && int_op(operand,AS_INT(left),AS_INT(right),&value))) \
+{ \
+    value=bin_op(operand,left,right); \
+    if (value==UNDEFINED){EVAL_FAIL;} \
+} \
+stack[--top-1]=value;
+#define DO_DELETE(operand) del_symbol(operand);
+#define DO_EXT(operand) stack[top-1]=externals[operand](stack[top-1]);
+#define DO_DUP stack[top]=stack[top-1]; top++;
+/********************************************
+*                    JIT                    *
+********************************************/
+/*
+    The machine code calls a helper for each instruction (with where 
+    the instruction is in the statements code) and returns as soon 
+    as one of them fails, it's the same as the evaluator but without 
+    the dispatch.
+*/
+typedef struct JIT_FRAME_STRUCT
+{
+    CodeType* code;
+    Value* stack;
+    int top;
+} JitFrame;
+typedef int (*NativeType)(JitFrame* frame, int* ip);
+
+#define EVAL_FAIL return 1
+#define JIT_HELPER(name,operation) \
+int name(JitFrame* frame, int* ip) \
+{ \
+    CodeType* code=frame->code; \
+    Value* stack=frame->stack; \
+    int top=frame->top; \
+    Value value, left, right; \
+    (void)code;(void)stack;(void)value;(void)left;(void)right; /* not every operation uses them */ \
+    operation \
+    frame->top=top; \
+    return 0; \
+}
+JIT_HELPER(jit_const,DO_CONST(OPERAND(*ip)))
+JIT_HELPER(jit_load,DO_LOAD(OPERAND(*ip),SITE(ip)))
+JIT_HELPER(jit_store,DO_STORE(OPERAND(*ip),SITE(ip)))
+JIT_HELPER(jit_bin_op,DO_BIN_OP(OPERAND(*ip)))
+JIT_HELPER(jit_delete,DO_DELETE(OPERAND(*ip)))
+JIT_HELPER(jit_ext,DO_EXT(OPERAND(*ip)))
+JIT_HELPER(jit_dup,DO_DUP)
+#undef EVAL_FAIL
+int (*jit_helpers[BASE_OPCODES])(JitFrame*, int*)={NULL,jit_const,jit_load,jit_store,jit_bin_op,jit_delete,jit_ext,jit_dup};
+
+/* the opcode a superinstruction starts with (SUPERINSTRUCTIONS are in the same order as the opcodes) */
+int base_opcode(int opcode){return opcode < BASE_OPCODES ? opcode : SUPERINSTRUCTIONS[opcode-BASE_OPCODES][1];}
+/* the entry for the statements sequence of opcodes (NULL once the cache is half full) */
+JitEntry* jit_entry(CodeType* code, int start)
+{
+    int* ip=code->code+start;
+    unsigned int hash=2166136261u;
+    int length=0;
+    for (; OPCODE(ip[length])!=OP_END; length++){hash=(hash^base_opcode(OPCODE(ip[length])))*16777619u;}
+    for (unsigned int i = hash;; i++)
+    {
+        JitEntry* entry=&jit_cache[i&(JIT_CACHE_SIZE-1)];
+        if (entry->opcodes==NULL)
+        {
+            if (jit_entries >= JIT_CACHE_SIZE/2){return NULL;}
+            jit_entries++;
+            entry->opcodes=malloc((length+1)*sizeof(int));
+            for (int j = 0; j < length; j++){entry->opcodes[j]=base_opcode(OPCODE(ip[j]));}
+            entry->length=length;
+            entry->hash=hash;
+            return entry;
+        }
+        if (entry->hash!=hash || entry->length!=length){continue;}
+        int j=0;
+        while (j < length && entry->opcodes[j]==base_opcode(OPCODE(ip[j]))){j++;}
+        if (j==length){return entry;}
+    }
+}
+#if defined(__x86_64__) && defined(__linux__)
+/*
+    templates (the zeros are patched):
+
+    push rbx; push r12; push r13; push r14; push rbp; mov rbx, rsi (ip); mov r12, rdi (frame); 
+    mov r13, [rdi+8] (frame->stack); mov rax, [rdi]; mov r14, [rax+disp8] (frame->code->values)
+
+    mov rdi, r12; lea rsi, [rbx+disp32]; mov rax, imm64 (helper); call rax; test eax, eax; jnz rel32 (exit)
+
+    xor eax, eax; exit: pop rbp; pop r14; pop r13; pop r12; pop rbx; ret
+*/
+unsigned char jit_prologue[]={0x53,0x41,0x54,0x41,0x55,0x41,0x56,0x55,0x48,0x89,0xf3,0x49,0x89,0xfc,0x4c,0x8b,0x6f,0x08,0x48,0x8b,0x07,0x4c,0x8b,0x70,0};
+#define JIT_PATCH_VALUES 24
+unsigned char jit_instruction[]={0x4c,0x89,0xe7,0x48,0x8d,0xb3,0,0,0,0,0x48,0xb8,0,0,0,0,0,0,0,0,0xff,0xd0,0x85,0xc0,0x0f,0x85,0,0,0,0};
+#define JIT_PATCH_DISP 6
+#define JIT_PATCH_HELPER 12
+#define JIT_PATCH_EXIT 26
+unsigned char jit_epilogue[]={0x31,0xc0,0x5d,0x41,0x5e,0x41,0x5d,0x41,0x5c,0x5b,0xc3};
+#define JIT_EXIT 2 // where exit is in the epilogue
+/*
+    stencils that do the instruction inline instead of calling its helper 
+    (the top is left in the frame since the helpers use it):
+
+    CONST:  mov eax, [rbx+disp32]; sar eax, 8; mov rdx, [r14+rax*8]; 
+            movsxd rcx, [r12+16]; mov [r13+rcx*8], rdx; inc dword [r12+16]
+
+    DUP:    movsxd rcx, [r12+16]; mov rdx, [r13+rcx*8-8]; mov [r13+rcx*8], rdx; inc dword [r12+16]
+
+    BIN_OP: mov eax, [rbx+disp32]; sar eax, 8; cmp eax, 1; ja slow; 
+            movsxd rcx, [r12+16]; mov rdx, [r13+rcx*8-16]; mov rsi, [r13+rcx*8-8]; 
+            mov rdi, rdx; shr rdi, 48; cmp edi, 0xfff9; jne slow; (the same for rsi) 
+            shl rdx, 16; sar rdx, 16; shl rsi, 16; sar rsi, 16; 
+            test eax, eax; jnz subtract; add rdx, rsi; jmp box; subtract: sub rdx, rsi; 
+            box: mov rdi, rdx; shl rdi, 16; sar rdi, 16; cmp rdi, rdx; jne slow; 
+            mov rdi, 0xffffffffffff; and rdx, rdi; mov rdi, 0xfff9000000000000; or rdx, rdi; 
+            mov [r13+rcx*8-16], rdx; dec dword [r12+16]; jmp rel32 (past slow); slow: 
+
+    so BIN_OP only does + and - of two ints that stay in 48 bits inline, 
+    anything else goes to the helper call (the instruction template) after it.
+*/
+unsigned char jit_const_stencil[]={0x8b,0x83,0,0,0,0,0xc1,0xf8,0x08,0x49,0x8b,0x14,0xc6,0x49,0x63,0x4c,0x24,0x10,0x49,0x89,0x54,0xcd,0,0x41,0xff,0x44,0x24,0x10};
+unsigned char jit_dup_stencil[]={0x49,0x63,0x4c,0x24,0x10,0x49,0x8b,0x54,0xcd,0xf8,0x49,0x89,0x54,0xcd,0,0x41,0xff,0x44,0x24,0x10};
+unsigned char jit_bin_op_stencil[]={0x8b,0x83,0,0,0,0,0xc1,0xf8,0x08,0x83,0xf8,0x01,0x0f,0x87,0x82,0,0,0,0x49,0x63,0x4c,0x24,0x10,
+0x49,0x8b,0x54,0xcd,0xf0,0x49,0x8b,0x74,0xcd,0xf8,0x48,0x89,0xd7,0x48,0xc1,0xef,0x30,0x81,0xff,0xf9,0xff,0,0,0x75,0x64,
+0x48,0x89,0xf7,0x48,0xc1,0xef,0x30,0x81,0xff,0xf9,0xff,0,0,0x75,0x55,0x48,0xc1,0xe2,0x10,0x48,0xc1,0xfa,0x10,0x48,0xc1,0xe6,0x10,
+0x48,0xc1,0xfe,0x10,0x85,0xc0,0x75,0x05,0x48,0x01,0xf2,0xeb,0x03,0x48,0x29,0xf2,0x48,0x89,0xd7,0x48,0xc1,0xe7,0x10,0x48,0xc1,0xff,0x10,
+0x48,0x39,0xd7,0x75,0x29,0x48,0xbf,0xff,0xff,0xff,0xff,0xff,0xff,0,0,0x48,0x21,0xfa,0x48,0xbf,0,0,0,0,0,0,0xf9,0xff,0x48,0x09,0xfa,
+0x49,0x89,0x54,0xcd,0xf0,0x41,0xff,0x4c,0x24,0x10,0xe9,sizeof(jit_instruction),0,0,0};
+#define JIT_STENCIL_DISP 2
+
+typedef struct JIT_STENCIL_STRUCT
+{
+    unsigned char* bytes;
+    int length;
+    int disp; // 1 if it reads the instruction (at JIT_STENCIL_DISP)
+    int helper; // 1 if the instruction template follows it (for what it can't do inline)
+} JitStencil;
+JitStencil jit_stencils[BASE_OPCODES]=
+{
+    [OP_CONST]={jit_const_stencil,sizeof(jit_const_stencil),1,0},
+    [OP_DUP]={jit_dup_stencil,sizeof(jit_dup_stencil),0,0},
+    [OP_BIN_OP]={jit_bin_op_stencil,sizeof(jit_bin_op_stencil),1,1},
+};
+/* how many bytes of machine code the instruction is */
+int jit_length_of(int opcode)
+{
+    JitStencil* stencil=&jit_stencils[opcode];
+    if (stencil->bytes==NULL){return sizeof(jit_instruction);}
+    return stencil->length+(stencil->helper ? sizeof(jit_instruction) : 0);
+}
+
+/* copies and patches the templates for the entry into executable memory */
+int jit_compile(JitEntry* entry)
+{
+    int length=sizeof(jit_prologue)+sizeof(jit_epilogue);
+    for (int i = 0; i < entry->length; i++){length+=jit_length_of(entry->opcodes[i]);}
+    if (jit_memory==NULL)
+    {
+        jit_memory=mmap(NULL, JIT_MEMORY, PROT_READ|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (jit_memory==MAP_FAILED){jit_memory=NULL;jit_enabled=0;return 0;}
+    }
+    if (jit_length+length > JIT_MEMORY){return 0;}
+    // it's only writable while it's being written to
+    mprotect(jit_memory, JIT_MEMORY, PROT_READ|PROT_WRITE);
+    unsigned char* native=jit_memory+jit_length, *at=native;
+    memcpy(at, jit_prologue, sizeof(jit_prologue));
+    at[JIT_PATCH_VALUES]=offsetof(CodeType, values);
+    at+=sizeof(jit_prologue);
+    int exit=length-sizeof(jit_epilogue)+JIT_EXIT;
+    for (int i = 0; i < entry->length; i++)
+    {
+        JitStencil* stencil=&jit_stencils[entry->opcodes[i]];
+        int disp=i*sizeof(int);
+        if (stencil->bytes)
+        {
+            memcpy(at, stencil->bytes, stencil->length);
+            if (stencil->disp){memcpy(at+JIT_STENCIL_DISP, &disp, 4);}
+            at+=stencil->length;
+            if (!stencil->helper){continue;}
+        }
+        memcpy(at, jit_instruction, sizeof(jit_instruction));
+        void* helper=jit_helpers[entry->opcodes[i]];
+        memcpy(at+JIT_PATCH_DISP, &disp, 4);
+        memcpy(at+JIT_PATCH_HELPER, &helper, 8);
+        int rel=exit-(at+sizeof(jit_instruction)-native); // from the end of the jnz (the end of the template)
+        memcpy(at+JIT_PATCH_EXIT, &rel, 4);
+        at+=sizeof(jit_instruction);
+    }
+    memcpy(at, jit_epilogue, sizeof(jit_epilogue));
+    mprotect(jit_memory, JIT_MEMORY, PROT_READ|PROT_EXEC);
+    __builtin___clear_cache((char*)native, (char*)native+length);
+    jit_length+=(length+15)&~15;
+    entry->native=native;
+    entry->native_length=length;
+    return 1;
+}
+#else
+int jit_compile(JitEntry* entry){return 0;}
+#endif
+/* compiles every sequence that's been evaluated (\-compile) */
+void jit_compile_all()
+{
+    for (int i = 0; i < JIT_CACHE_SIZE; i++){if (jit_cache[i].opcodes && jit_cache[i].native==NULL){jit_compile(&jit_cache[i]);}}
+    jit_pending=0;
+}
+#define EVAL_FAIL return
+void eval_code(CodeType* code, int start)
+{
+    if (fuse_profiling){fuse_profile(code,start);}
+    Value stack[EVAL_STACK_SIZE];
+    if (jit_enabled && OPCODE(code->code[start])!=OP_END)
+    {
+        if (jit_pending){jit_compile_all();}
+        // the entry's kept in the statements OP_END so it's only looked up the first time
+        int* end=code->code+start;
+        while (OPCODE(*end)!=OP_END){end++;}
+        JitEntry* entry = END_ENTRY(OPERAND(*end)) ? &jit_cache[END_ENTRY(OPERAND(*end))-1] : jit_entry(code,start);
+        if (entry && END_ENTRY(OPERAND(*end))==0){*end=INSTRUCTION(OP_END,OPERAND(*end) | (int)(entry-jit_cache+1) << END_FORM_BITS);}
+        if (entry && ++entry->count >= JIT_THRESHOLD && entry->native==NULL){jit_compile(entry);}
+        if (entry && entry->native)
+        {
+            JitFrame frame={code,stack,0};
+            ((NativeType)entry->native)(&frame,code->code+start);
+            return;
         }
     }
-}
\ No newline at end of file
+#if defined(__GNUC__)
+    static void* targets[OPCODE_COUNT]=
+    {
+        [OP_END]=&&label_OP_END,[OP_CONST]=&&label_OP_CONST,[OP_LOAD]=&&label_OP_LOAD,[OP_STORE]=&&label_OP_STORE,
+        [OP_BIN_OP]=&&label_OP_BIN_OP,[OP_DELETE]=&&label_OP_DELETE,[OP_EXT]=&&label_OP_EXT,[OP_DUP]=&&label_OP_DUP,
+        [OP_LOAD_LOAD_BIN_OP]=&&label_OP_LOAD_LOAD_BIN_OP,[OP_LOAD_CONST_BIN_OP]=&&label_OP_LOAD_CONST_BIN_OP,
+        [OP_LOAD_BIN_OP_STORE]=&&label_OP_LOAD_BIN_OP_STORE,[OP_CONST_BIN_OP_STORE]=&&label_OP_CONST_BIN_OP_STORE,
+        [OP_LOAD_LOAD]=&&label_OP_LOAD_LOAD,[OP_LOAD_CONST]=&&label_OP_LOAD_CONST,[OP_LOAD_BIN_OP]=&&label_OP_LOAD_BIN_OP,
+        [OP_CONST_BIN_OP]=&&label_OP_CONST_BIN_OP,[OP_BIN_OP_STORE]=&&label_OP_BIN_OP_STORE,[OP_CONST_STORE]=&&label_OP_CONST_STORE,
+        [OP_LOAD_EXT]=&&label_OP_LOAD_EXT,[OP_BIN_OP_EXT]=&&label_OP_BIN_OP_EXT,
+    };
+#endif
+    int top=0;
+    int* ip=code->code+start;
+    int instruction;
+    Value value, left, right;
+    DISPATCH_START
+    {
+        TARGET(OP_CONST) DO_CONST(OPERAND(instruction)) DISPATCH;
+        TARGET(OP_LOAD) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DISPATCH;
+        TARGET(OP_STORE) DO_STORE(OPERAND(instruction),SITE(ip-1)) DISPATCH;
+        TARGET(OP_BIN_OP) DO_BIN_OP(OPERAND(instruction)) DISPATCH;
+        TARGET(OP_DELETE) DO_DELETE(OPERAND(instruction)) DISPATCH;
+        TARGET(OP_EXT) DO_EXT(OPERAND(instruction)) DISPATCH;
+        TARGET(OP_DUP) DO_DUP DISPATCH;
+        // superinstructions (the operands after the first are in the instructions they replaced)
+        TARGET(OP_LOAD_LOAD_BIN_OP) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_LOAD(OPERAND(ip[0]),SITE(ip)) DO_BIN_OP(OPERAND(ip[1])) ip+=2; DISPATCH;
+        TARGET(OP_LOAD_CONST_BIN_OP) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_CONST(OPERAND(ip[0])) DO_BIN_OP(OPERAND(ip[1])) ip+=2; DISPATCH;
+        TARGET(OP_LOAD_BIN_OP_STORE) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_BIN_OP(OPERAND(ip[0])) DO_STORE(OPERAND(ip[1]),SITE(ip+1)) ip+=2; DISPATCH;
+        TARGET(OP_CONST_BIN_OP_STORE) DO_CONST(OPERAND(instruction)) DO_BIN_OP(OPERAND(ip[0])) DO_STORE(OPERAND(ip[1]),SITE(ip+1)) ip+=2; DISPATCH;
+        TARGET(OP_LOAD_LOAD) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_LOAD(OPERAND(ip[0]),SITE(ip)) ip++; DISPATCH;
+        TARGET(OP_LOAD_CONST) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_CONST(OPERAND(ip[0])) ip++; DISPATCH;
+        TARGET(OP_LOAD_BIN_OP) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_BIN_OP(OPERAND(ip[0])) ip++; DISPATCH;
+        TARGET(OP_CONST_BIN_OP) DO_CONST(OPERAND(instruction)) DO_BIN_OP(OPERAND(ip[0])) ip++; DISPATCH;
+        TARGET(OP_BIN_OP_STORE) DO_BIN_OP(OPERAND(instruction)) DO_STORE(OPERAND(ip[0]),SITE(ip)) ip++; DISPATCH;
+        TARGET(OP_CONST_STORE) DO_CONST(OPERAND(instruction)) DO_STORE(OPERAND(ip[0]),SITE(ip)) ip++; DISPATCH;
+        TARGET(OP_LOAD_EXT) DO_LOAD(OPERAND(instruction),SITE(ip-1)) DO_EXT(OPERAND(ip[0])) ip++; DISPATCH;
+        TARGET(OP_BIN_OP_EXT) DO_BIN_OP(OPERAND(instruction)) DO_EXT(OPERAND(ip[0])) ip++; DISPATCH;
+        TARGET(OP_END) return;
+    }
+}
+/* eval_code one instruction at a time (through the JIT helpers) so each one can be timed (\-profile) */
+void eval_profiled(CodeType* code, int start)
+{
+    Value stack[EVAL_STACK_SIZE];
+    JitFrame frame={code,stack,0};
+    unsigned long long began=profile_clock();
+    int* ip=code->code+start;
+    for (; OPCODE(*ip)!=OP_END; ip++)
+    {
+        int opcode=base_opcode(OPCODE(*ip));
+        unsigned long long before=profile_clock();
+        int failed=jit_helpers[opcode](&frame,ip);
+        profile_add(&profile_opcodes[opcode],profile_clock()-before);
+        if (failed){break;}
+    }
+    while (OPCODE(*ip)!=OP_END){ip++;}
+    unsigned long long cycles=profile_clock()-began;
+    profile_add(profile_form(END_FORM(OPERAND(*ip))),cycles);
+    profile_add(&profile_phases[PHASE_EVAL],cycles);
+}
+/* evaluates the statement starting at start in the code */
+void eval(CodeType* code, int start)
+{
+    if (profiling){eval_profiled(code,start);}
+    else{eval_code(code,start);}
+    gc_safepoint();
+}
@@ -36,9 +36,15 @@
     When you modify grammar you're modifying the custom grammar 
     arrays that take precedence over the default modifiable grammars.
 
-    Note: the more custom grammars you add the longer it will take to tokenize
-    because it has to do a linear search for the matches and then perform a 
-    linear search on each match to compare the characters to match the grammar.
+    Note: the start grammars are matched with a trie (the longest matching
+    start grammar wins) and the end grammars are searched for with an
+    Aho-Corasick automaton, so adding custom grammars doesn't slow down
+    tokenizing (the automata are rebuilt whenever the grammar changes).
+    \-lexer dfa compiles the grammar and consts into a single DFA instead.
+
+    The lexers never read these arrays directly but a snapshot of them 
+    (GrammarSnapshot in utils.c) that's published after each internal 
+    command, so a lexer keeps the grammar it has until its next unit.
 
     Forms:
 
@@ -64,22 +70,31 @@
     and the corresponding index in the EXEC_FORMS array (the instructions used to
     executed the form)
     
-    The FORMS array is used to match a sequence of tokens to a form.
+    The FORMS array is compiled into a trie keyed by token type that 
+    is used to match a sequence of tokens to a form (it's rebuilt 
+    into the grammar snapshot whenever a form is added or removed).
 
      - If no match is found the parser raises an error.
 
-     - If a single match is found that's the form used.
-       - if an abstract form was encountered then this will be recursed on
+     - If a form ends on the token and no other forms carry on 
+       from it that's the form used.
+
+     - If other forms carry on from it the parser continues to 
+       the next token.
+
+     - If the token doesn't carry on any form but an abstract form 
+       does, the abstract form is recursed on from the token.
 
-     - If at least two matches are found the parser continues 
-       to the next token until a unique match is found or the 
-       max form length is reached.
+     - If neither carry it on the parser goes back to the last token 
+       an abstract form could've been recursed on from instead and 
+       once there are none left the longest form that matched is used
+       (abstract forms are memoized so none are matched twice).
     
      - if an abstract form is directly beside another abstract form
        an error will be raised since this doesn't make sense because
        you'd end up recursing on potentially irrelevant tokens/forms.
 
-    Note: as with more custom grammars, more forms will add overhead.
+    Note: each token is a single lookup so more forms don't add overhead.
 */
 /**********************************
 *         CUSTOM GRAMMAR          *
@@ -168,7 +183,7 @@ enum DEFAULT_GRAMMAR
 **********************************/
 
 #define MAX_FORM_SIZE 10
-#define MAX_FORM_ITEMS 100
+#define MAX_FORM_ITEMS 1000
 
 /*
     formations used to identify each of the forms (can be changed)
@@ -176,7 +191,7 @@ enum DEFAULT_GRAMMAR
 int FORMS[MAX_FORM_ITEMS][MAX_FORM_SIZE] = \
 {
     {TOKEN_ID,TOKEN_OPERATOR,TOKEN_ID}, // Bin_op
-    {TOKEN_ID,TOKEN_LPAREN}, // LOAD frame_init, STORE new_frame in globals
+    {TOKEN_ID,TOKEN_LPAREN}, // LOAD frame_init (pushes new_frame on the frame stack)
     {OBJECT,TOKEN_OPERATOR,ABSTRACT_FORM,OBJECT},
     // {ABSTRACT_FORM,FORM_VALUE,TOKEN_OPERATOR,ABSTRACT_FORM,FORM_VALUE}, // BIN_OP
 
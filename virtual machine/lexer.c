@@ -3,20 +3,50 @@
 
     | Function       | line number |
     --------------------------------
-    lexer_isrunning     -  28
-    token_init          -  31
-    lexer_init          -  38
-    lexer_next          -  48
-    COLLECTOR           -  60
-    IS_CONST            -  74
-    next_token          -  88
-    token_type          - 112
-    collect_token       - 116
-    HAS_LEXER_ENDED     - 156
-    collect_string      - 158
-    compare_grammar     - 185
-    SKIP                - 196
-    check_grammar       - 200
+    lexer_isrunning     -  58
+    token_init          -  65
+    token_span          -  79
+    token_value         -  92
+    lexer_init          - 103
+    lexer_init_stream   - 123
+    lexer_init_file     - 140
+    lexer_init_span     - 178
+    lexer_free          - 191
+    lexer_refresh       - 202
+    lexer_fill          - 215
+    lexer_seek          - 242
+    lexer_next          - 251
+    token_type          - 289
+    build_char_tables   - 291
+    build_char_classes  - 335
+    COLLECTOR           - 359
+    IS_CONST            - 367
+    collect_whitespace  - 371
+    collect_number      - 372
+    collect_id          - 373
+    collect_end         - 374
+    collect_newline     - 384
+    collect_token       - 392
+    HAS_LEXER_ENDED     - 400
+    scan_chars          - 407
+    collect_string      - 437
+    compare_grammar     - 459
+    SKIP                - 471
+    build_grammar_automata - 481
+    find_end            - 503
+    lexer_internal      - 537
+    check_grammar       - 550
+    collect_grammar_token - 589
+    dfa_state           - 652
+    dfa_end             - 679
+    HAS_BODY            - 701
+    build_dfa           - 706
+    dfa_free            - 870
+    DUMP_ARRAY          - 876
+    dfa_dump            - 882
+    dfa_token           - 906
+    next_token          - 977
+    lex_into            - 996
 
 */
 #include "utils.c"
@@ -25,158 +55,425 @@
 *         Defining the token and lexer functions         *
 *********************************************************/
 
-int lexer_isrunning(LexerType* lexer){return (lexer->value != '\0' && lexer->index < lexer->length);}
+int lexer_isrunning(LexerType* lexer)
+{
+    if (lexer->index >= lexer->length){lexer_fill(lexer, 1);} // streams are refilled lazily
+    return (lexer->value != '\0' && lexer->index < lexer->length);
+}
 
 // token and lexer setup
 TokenType* token_init(int type, char* value)
 {
-    TokenType* token = calloc(1, sizeof(struct TOKEN_STRUCT));
+    TokenType* token = arena_alloc(&unit_arena, sizeof(struct TOKEN_STRUCT));
     token->type = type;
     token->value = value;
     return token;
 }
+/* 
+    creates a token that refers to a section of the source code 
+    rather than copying it (the string is made by token_value) 
+
+    Note: a streams window moves when it's refilled so its spans 
+    are copied straight away
+*/
+TokenType* token_span(LexerType* lexer, int type, int start, int length)
+{
+    TokenType* token = token_init(type, NULL);
+    token->source = lexer->source;
+    token->start = start;
+    token->length = length;
+    if (lexer->capacity){token_value(token);token->source = NULL;}
+    return token;
+}
+/* 
+    gets the tokens value, copying the span out of the source on 
+    first use (ids and consts use their interned name instead)
+*/
+char* token_value(TokenType* token)
+{
+    if (token->value == NULL && token->symbol){token->value = symbol_name(token->symbol);}
+    else if (token->value == NULL && token->source != NULL)
+    {
+        token->value = arena_alloc(&unit_arena, (token->length + 1) * sizeof(char));
+        memcpy(token->value, token->source + token->start, token->length);
+        token->value[token->length] = '\0';
+    }
+    return token->value;
+}
 LexerType* lexer_init(char* source)
 {
-    LexerType* lexer = calloc(1, sizeof(struct LEXER_STRUCT));
+    LexerType* lexer = arena_alloc(&unit_arena, sizeof(struct LEXER_STRUCT));
     lexer->source = source;
     lexer->length = strlen(source);
     lexer->index = 0;
     lexer->value = source[lexer->index];
+    lexer->tokens = &unit_tokens;
+    token_buffer_clear(&unit_tokens); // a new lexer starts a new unit
+    // it's in the arena so the unit holds the reference (until the next one)
+    grammar_release(unit_grammar);
+    unit_grammar = lexer->grammar = grammar_acquire();
+    lexer->borrowed = 1;
     return lexer;
 }
-/* move the lexer onto the next character */
-void lexer_next(LexerType* lexer)
+/* 
+    lexes a stream in chunks (the lexer outlives the unit_arena 
+    so it's on the heap and has to be freed with lexer_free)
+*/
+#define LEXER_CHUNK_SIZE 65536
+/* 
+    reads what the stream has (up to size) returning 0 at its end, on 
+    Windows it's read with stdio instead (a line at a time if it's 
+    interactive so the REPL doesn't wait for a whole chunk)
+*/
+int stream_read(FILE* stream, char* buffer, int size, int interactive)
+{
+#ifndef _WIN32
+    return read(fileno(stream), buffer, size);
+#else
+    if (!interactive){return fread(buffer, 1, size, stream);}
+    if (fgets(buffer, size + 1, stream) == NULL){return 0;}
+    return strlen(buffer);
+#endif
+}
+int stream_interactive(FILE* stream)
 {
-    if (lexer_isrunning(lexer)) // we have to deal with null bytes since c truncates it
+#ifndef _WIN32
+    return isatty(fileno(stream));
+#else
+    return _isatty(_fileno(stream));
+#endif
+}
+LexerType* lexer_init_stream(FILE* stream)
+{
+    LexerType* lexer = calloc(1, sizeof(struct LEXER_STRUCT));
+    lexer->stream = stream;
+    lexer->interactive = stream_interactive(stream);
+    lexer->capacity = LEXER_CHUNK_SIZE;
+    lexer->source = malloc(lexer->capacity * sizeof(char));
+    lexer->source[0] = '\0';
+    lexer->tokens = &unit_tokens;
+    token_buffer_clear(&unit_tokens); // a new lexer starts a new unit
+    lexer->grammar = grammar_acquire();
+    return lexer;
+}
+/* 
+    lexes a whole file by memory mapping it (it gets streamed instead 
+    if it can't be mapped) returning NULL if it can't be opened
+*/
+LexerType* lexer_init_file(char* path)
+{
+#ifndef _WIN32
+    int file = open(path, O_RDONLY);
+    if (file == -1){return NULL;}
+    struct stat info;
+    if (fstat(file, &info) == 0 && info.st_size > 0 && info.st_size < INT_MAX)
     {
-        lexer->index += 1;
-        lexer->value = lexer->source[lexer->index];
+        char* source = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (source != MAP_FAILED)
+        {
+            close(file);
+            madvise(source, info.st_size, MADV_SEQUENTIAL);
+            LexerType* lexer = calloc(1, sizeof(struct LEXER_STRUCT));
+            lexer->source = source;
+            lexer->length = info.st_size;
+            lexer->mapped = 1;
+            lexer->value = source[0];
+            lexer->tokens = &unit_tokens;
+            token_buffer_clear(&unit_tokens);
+            lexer->grammar = grammar_acquire();
+            return lexer;
+        }
     }
+    close(file);
+#endif
+    FILE* stream = fopen(path, "rb");
+    if (stream == NULL){return NULL;}
+    LexerType* lexer = lexer_init_stream(stream);
+    lexer->owned = 1;
+    return lexer;
+}
+/* 
+    lexes a source that's shared with other lexers (i.e. a mapped file) 
+    from index on with the grammar given, so the threads in eval_script 
+    can each start from their own chunk (it's on the heap and has to be 
+    freed with lexer_free)
+*/
+LexerType* lexer_init_span(char* source, int length, int index, GrammarSnapshot* grammar)
+{
+    LexerType* lexer = calloc(1, sizeof(struct LEXER_STRUCT));
+    lexer->source = source;
+    lexer->length = length;
+    lexer->index = index;
+    lexer->value = index < length ? source[index] : '\0';
+    lexer->tokens = &unit_tokens; // the threads own one
+    token_buffer_clear(&unit_tokens);
+    lexer->grammar = grammar_retain(grammar);
+    return lexer;
+}
+/* frees a lexer made by lexer_init_stream or lexer_init_file */
+void lexer_free(LexerType* lexer)
+{
+#ifndef _WIN32
+    if (lexer->mapped){munmap(lexer->source, lexer->length);}
+#endif
+    if (lexer->capacity){free(lexer->source);}
+    if (lexer->owned){fclose(lexer->stream);}
+    grammar_release(lexer->grammar);
+    free(lexer);
+}
+/* moves the lexer onto the newest grammar */
+void lexer_refresh(LexerType* lexer)
+{
+    GrammarSnapshot* grammar=grammar_acquire();
+    if (lexer->borrowed){grammar_release(unit_grammar);unit_grammar=grammar;}
+    else{grammar_release(lexer->grammar);}
+    lexer->grammar=grammar;
+    lexer->stale=0;
+}
+/* 
+    makes sure count characters from the index are in the source if 
+    the input has them, refilling the stream if needed (anything before 
+    the marker is dropped), and returns how many characters are left
+*/
+int lexer_fill(LexerType* lexer, int count)
+{
+    while (lexer->capacity && !lexer->ended && lexer->length - lexer->index < count)
+    {
+        int marker = lexer->marker < lexer->index ? lexer->marker : lexer->index;
+        lexer->offset += marker;
+        lexer->length -= marker;
+        lexer->index -= marker;
+        lexer->marker -= marker;
+        memmove(lexer->source, lexer->source + marker, lexer->length);
+        // a token that doesn't fit in the window grows it
+        if (lexer->capacity - lexer->length < LEXER_CHUNK_SIZE / 2)
+        {
+            lexer->capacity *= 2;
+            lexer->source = realloc(lexer->source, lexer->capacity * sizeof(char));
+        }
+        if (lexer->prompt){printf("%s", lexer->prompt);fflush(stdout);}
+        int size = stream_read(lexer->stream, lexer->source + lexer->length, lexer->capacity - lexer->length - 1, lexer->interactive);
+        if (size <= 0){lexer->ended = 1;}
+        else{lexer->length += size;}
+        lexer->source[lexer->length] = '\0';
+    }
+    // mapped files have no null byte after them
+    lexer->value = lexer->index < lexer->length ? lexer->source[lexer->index] : '\0';
+    return lexer->length - lexer->index;
+}
+/* moves the lexer onto index (at most the end of the source) */
+void lexer_seek(LexerType* lexer, int index)
+{
+    lexer->index = index;
+    if (index < lexer->length){lexer->value = lexer->source[index];}
+    // the next line of a terminal is waited on only when it's needed
+    else if (lexer->interactive && index > 0 && lexer->source[index-1] == '\n'){lexer->value = '\0';}
+    else{lexer_fill(lexer, 1);}
+}
+/* move the lexer onto the next character */
+void lexer_next(LexerType* lexer)
+{
+    if (lexer_isrunning(lexer)){lexer_seek(lexer, lexer->index + 1);} // we have to deal with null bytes since c truncates it
 }
 /**********************************************************
 *    The main lexing function to tokenize source code     *
 **********************************************************/
-/* collects a series of same tokens based on a condition function*/
-#define COLLECTOR(condition,token,macro) \
-char* value = calloc(1, sizeof(char)); \
-value[0] = '\0'; \
-char* str; \
-while (condition(lexer->value)) \
-{ \
-    str = char_to_string(lexer); \
-    value = realloc(value, (strlen(value) + strlen(str) + 1) * sizeof(char)); \
-    strcat(value, str); \
-} \
-macro \
-return token_init(token, value);
+/*
+    Every character is classified by a 256 entry table so that picking 
+    how to tokenize it is a single lookup (see lexer_actions and next_token).
 
-/* checks if an ID is a constant */
-#define IS_CONST \
-int i=0; \
-str=consts[0]; \
-while (str && i < MAX_GRAMMAR_SIZE) \
-{ \
-    if (strcmp(str,value)==0){return token_init(TOKEN_CONST, value);} \
-    i++; \
-    str=consts[i]; \
-}
+    char_class - which action tokenizes a character
+    char_token - the builtin token of a single character (TOKEN_ERROR if it has none)
+    char_flags - what the collectors collect while the condition holds
 
-/* 
-    Tokenizes based on a single character; it will use look 
-    aheads to collect multiple characters if necessary
+    char_class is in the grammar snapshot since a character that starts a 
+    custom grammar has to be checked first (the others never change).
 */
-TokenType* next_token(LexerType* lexer)
+enum CHAR_CLASS
+{
+    CLASS_END,
+    CLASS_NEWLINE,
+    CLASS_WHITESPACE,
+    CLASS_NUMBER,
+    CLASS_ID,
+    CLASS_STRING,
+    CLASS_GRAMMAR,
+    CLASS_TOKEN
+};
+int char_token[256];
+unsigned char char_flags[256];
+#define FLAG_SPACE 1
+#define FLAG_DIGIT 2
+#define FLAG_ALNUM 4
+#define is_space(c) (char_flags[(unsigned char)(c)] & FLAG_SPACE)
+#define is_digit(c) (char_flags[(unsigned char)(c)] & FLAG_DIGIT)
+#define is_alnum(c) (char_flags[(unsigned char)(c)] & FLAG_ALNUM)
+
+#define token_type(case_type, type) char_token[case_type]=type;
+int char_tables=0; // char_token and char_flags are built once
+void build_char_tables()
 {
-    if (lexer->value == '\0')
+    for (int c = 0; c < 256; c++)
     {
-        // lets you know when tokenization's done
-        if (lexer->index == lexer->length){return token_init(TOKEN_EOF, "\0");}
-        else{return token_init(TOKEN_ERROR, "\0");}
+        char_token[c]=TOKEN_ERROR;
+        char_flags[c]=(isspace(c) ? FLAG_SPACE : 0) | (isdigit(c) ? FLAG_DIGIT : 0) | (isalnum(c) ? FLAG_ALNUM : 0);
     }
-    if (lexer->value == '\n')
+    /* parentheses */
+    token_type('(', TOKEN_LPAREN);
+    token_type(')', TOKEN_RPAREN);
+    token_type('[', TOKEN_LBRACE);
+    token_type(']', TOKEN_RBRACE);
+    token_type('{', TOKEN_LCBRACE);
+    token_type('}', TOKEN_RCBRACE);
+    /* modifiable tokens */
+    token_type('`', TOKEN_BACKTICK);
+    token_type('~', TOKEN_TILDE);
+    token_type('!', TOKEN_NOT);
+    token_type('@', TOKEN_AT);
+    token_type('#', TOKEN_HASH);
+    token_type('$', TOKEN_DOLLAR);
+    token_type('%', TOKEN_PERCENT);
+    token_type('^', TOKEN_CARET);
+    token_type('&', TOKEN_AMPERSAND);
+    token_type('*', TOKEN_ASTERISK);
+    token_type('_', TOKEN_UNDERSCORE);
+    token_type('-', TOKEN_MINUS);
+    token_type('=', TOKEN_EQUALS);
+    token_type('+', TOKEN_PLUS);
+    token_type('\\', TOKEN_LINE_CONTINUATION);
+    token_type('|', TOKEN_OR);
+    token_type(';', TOKEN_SEMICOLON);
+    token_type(':', TOKEN_COLON);
+    token_type('/', TOKEN_SLASH);
+    token_type('?', TOKEN_QUESTION);
+    token_type('.', TOKEN_DOT);
+    token_type('>', TOKEN_GREATER);
+    token_type(',', TOKEN_COMMA);
+    token_type('<', TOKEN_LESS);
+    char_tables=1;
+}
+/* 
+    builds the grammars char_class (only the custom grammar can change it)
+*/
+void build_char_classes(GrammarSnapshot* grammar)
+{
+    if (!char_tables){build_char_tables();}
+    unsigned char* char_class=grammar->char_class;
+    // the order here is the order of precedence
+    for (int c = 0; c < 256; c++)
     {
-        lexer_next(lexer);
-        return token_init(TOKEN_NEWLINE, "\\n");
+        if (c == '\0'){char_class[c]=CLASS_END;}
+        else if (c == '\n'){char_class[c]=CLASS_NEWLINE;}
+        else if (isspace(c)){char_class[c]=CLASS_WHITESPACE;}
+        // digits before ids (so that the varnames are correct regardless of what digits; in case wanting an algebra like syntax)
+        else if (isdigit(c)){char_class[c]=CLASS_NUMBER;}
+        else if (isalnum(c)){char_class[c]=CLASS_ID;}
+        else if (c == '"' || c == '\''){char_class[c]=CLASS_STRING;}
+        else{char_class[c]=CLASS_TOKEN;}
     }
-    if (isspace(lexer->value)){COLLECTOR(isspace,TOKEN_WHITESPACE,NULL;);}
-    // digits before ids (so that the varnames are correct regardless of what digits; in case wanting an algebra like syntax)
-    if (isdigit(lexer->value)){COLLECTOR(isdigit,TOKEN_NUMBER,NULL;);}
-    if (isalnum(lexer->value)){COLLECTOR(isalnum,TOKEN_ID,IS_CONST);}
-    if (lexer->value == '"' || lexer->value == '\''){return collect_string(lexer);}
     // check for custom grammar
-    TokenType* token=check_grammar(lexer);
-    if (token->type != TOKEN_ERROR){return token;} // TOKEN_ERROR implies no custom tokens were found
-    return collect_token(lexer);
+    for (int i = 0; i < len(grammar->start_grammar) && grammar->start_grammar[i]; i++)
+    {
+        unsigned char c = grammar->start_grammar[i][0];
+        if (char_class[c]==CLASS_TOKEN){char_class[c]=CLASS_GRAMMAR;}
+    }
 }
+/* collects a series of same tokens based on a condition function*/
+#define COLLECTOR(condition,token,macro) \
+lexer->marker = lexer->index; \
+while (condition(lexer->value)){lexer_next(lexer);} \
+TokenType* value = token_span(lexer, token, lexer->marker, lexer->index - lexer->marker); \
+macro \
+return value;
+
+/* interns an ID and checks if it's a constant */
+#define IS_CONST \
+value->symbol = symbol_intern(lexer->source + lexer->marker, value->length); \
+if (value->symbol < lexer->grammar->consts_length && lexer->grammar->consts[value->symbol]){value->type=TOKEN_CONST;}
 
-#define token_type(case_type, type) case case_type: return token_init(type, char_to_string(lexer));
+TokenType* collect_whitespace(LexerType* lexer){COLLECTOR(is_space,TOKEN_WHITESPACE,)}
+TokenType* collect_number(LexerType* lexer){COLLECTOR(is_digit,TOKEN_NUMBER,)}
+TokenType* collect_id(LexerType* lexer){COLLECTOR(is_alnum,TOKEN_ID,IS_CONST)}
+TokenType* collect_end(LexerType* lexer)
+{
+    // lets you know when tokenization's done
+    if (lexer->index == lexer->length)
+    {
+        if (lexer_fill(lexer, 1)){return next_token(lexer);}
+        return token_init(TOKEN_EOF, "\0");
+    }
+    return token_init(TOKEN_ERROR, "\0");
+}
+TokenType* collect_newline(LexerType* lexer)
+{
+    lexer_next(lexer);
+    return token_init(TOKEN_NEWLINE, "\\n");
+}
 /* 
-    switch statement that collects an individual token
+    collects an individual token
 */
 TokenType* collect_token(LexerType* lexer)
 {
-    switch (lexer->value)
-    {
-        /* parentheses */
-        token_type('(', TOKEN_LPAREN);
-        token_type(')', TOKEN_RPAREN);
-        token_type('[', TOKEN_LBRACE);
-        token_type(']', TOKEN_RBRACE);
-        token_type('{', TOKEN_LCBRACE);
-        token_type('}', TOKEN_RCBRACE);
-        /* modifiable tokens */
-        token_type('`', TOKEN_BACKTICK);
-        token_type('~', TOKEN_TILDE);
-        token_type('!', TOKEN_NOT);
-        token_type('@', TOKEN_AT);
-        token_type('#', TOKEN_HASH);
-        token_type('$', TOKEN_DOLLAR);
-        token_type('%', TOKEN_PERCENT);
-        token_type('^', TOKEN_CARET);
-        token_type('&', TOKEN_AMPERSAND);
-        token_type('*', TOKEN_ASTERISK);
-        token_type('_', TOKEN_UNDERSCORE);
-        token_type('-', TOKEN_MINUS);
-        token_type('=', TOKEN_EQUALS);
-        token_type('+', TOKEN_PLUS);
-        token_type('\\', TOKEN_LINE_CONTINUATION);
-        token_type('|', TOKEN_OR);
-        token_type(';', TOKEN_SEMICOLON);
-        token_type(':', TOKEN_COLON);
-        token_type('/', TOKEN_SLASH);
-        token_type('?', TOKEN_QUESTION);
-        token_type('.', TOKEN_DOT);
-        token_type('>', TOKEN_GREATER);
-        token_type(',', TOKEN_COMMA);
-        token_type('<', TOKEN_LESS);
-    }
-    return token_init(TOKEN_ERROR, (char[]){lexer->value,'\0'});
-}
-
-#define HAS_LEXER_ENDED if (lexer->value == '\0'){return token_init(TOKEN_ERROR, value);}
+    int type=char_token[(unsigned char)lexer->value];
+    if (type==TOKEN_ERROR){return token_span(lexer, TOKEN_ERROR, lexer->index, 1);}
+    lexer_next(lexer);
+    return token_span(lexer, type, lexer->marker, 1);
+}
+
+#define HAS_LEXER_ENDED if (lexer->value == '\0'){return token_span(lexer, TOKEN_ERROR, lexer->marker, lexer->index - lexer->marker);}
+
+/*
+    finds the first a, b or c in the source from index up to length 
+    (returning length if there isn't one) by comparing 32 or 16 
+    characters at a time where AVX2 or SSE2 is available
+*/
+int scan_chars(char* source, int index, int length, char a, char b, char c)
+{
+#if defined(__AVX2__)
+    __m256i a32 = _mm256_set1_epi8(a), b32 = _mm256_set1_epi8(b), c32 = _mm256_set1_epi8(c);
+    for (; index + 32 <= length; index += 32)
+    {
+        __m256i block = _mm256_loadu_si256((__m256i*)(source + index));
+        __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, a32), _mm256_cmpeq_epi8(block, b32)), _mm256_cmpeq_epi8(block, c32));
+        unsigned int mask = _mm256_movemask_epi8(found);
+        if (mask){return index + __builtin_ctz(mask);}
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i a16 = _mm_set1_epi8(a), b16 = _mm_set1_epi8(b), c16 = _mm_set1_epi8(c);
+    for (; index + 16 <= length; index += 16)
+    {
+        __m128i block = _mm_loadu_si128((__m128i*)(source + index));
+        __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, a16), _mm_cmpeq_epi8(block, b16)), _mm_cmpeq_epi8(block, c16));
+        unsigned int mask = _mm_movemask_epi8(found);
+        if (mask){return index + __builtin_ctz(mask);}
+    }
+#endif
+    for (; index < length; index++)
+    {
+        char value = source[index];
+        if (value == a || value == b || value == c){return index;}
+    }
+    return length;
+}
 
 TokenType* collect_string(LexerType* lexer)
 {
     char reference_char=lexer->value;
     lexer_next(lexer); // to skip the " or ' chars
-    char* value = calloc(1, sizeof(char));
-    value[0] = '\0';
-    int back_slash = 0;
-    // passes a through
-    while (lexer->value != reference_char || back_slash) // backslashes allow for \" and \'
+    lexer->marker = lexer->index;
+    // jumps between the quotes and backslashes (backslashes allow for \" and \')
+    while (1)
     {
+        lexer->index = scan_chars(lexer->source, lexer->index, lexer->length, reference_char, '\\', '\0');
+        lexer_fill(lexer, 1); // refills the stream if the window's been scanned
+        if (lexer->value == reference_char){break;}
         HAS_LEXER_ENDED;
-        // get the backslash first because it'll get lost when char_to_string runs lexer_next
-        if (lexer->value == '\\' && back_slash==0)
-        {back_slash = 1;} 
-        else if (back_slash==1)
-        {back_slash = 0;}
-        char* str = char_to_string(lexer);
-        value = realloc(value, (strlen(value) + strlen(str) + 1) * sizeof(char));
-        strcat(value, str);
+        if (lexer->value == '\\'){lexer_next(lexer);HAS_LEXER_ENDED;lexer_next(lexer);} // skip what's escaped
     }
+    TokenType* token = token_span(lexer, TOKEN_STRING, lexer->marker, lexer->index - lexer->marker);
     lexer_next(lexer); // to skip the " or ' chars
-    return token_init(TOKEN_STRING, value);
+    return token;
 }
 /* 
     compares two strings to see if they are the same
@@ -187,61 +484,578 @@ int compare_grammar(LexerType* lexer,char* compare)
     char value;
     for (int i = 0; i < strlen(compare); i++)
     {
+        if (lexer_fill(lexer,i+1) <= i){return 1;}
         value=lexer->source[lexer->index+i];
         if (value != compare[i]){return 1;}
     }
     return 0;
 }
 /* moves the lexer forwards to skip values */
-#define SKIP(value) for (int j = 0; j < strlen(value); j++){lexer_next(lexer);}
+#define SKIP(length) for (int j = 0; j < length; j++){lexer_next(lexer);}
+/*
+    The custom grammar is matched with two automata that are built for 
+    each grammar snapshot (i.e. after add_grammar or remove_grammar):
+
+    start_automaton - a trie of the start grammars used to find the 
+                      longest start grammar at the current character
+    end_automaton   - an Aho-Corasick automaton of the end grammars used 
+                      to search for the end of a skipped or collected grammar
+                      (only built without SSE2, see find_end)
+*/
+void build_grammar_automata(GrammarSnapshot* grammar)
+{
+    automaton_clear(&grammar->start_automaton);
+#if !defined(__SSE2__)
+    automaton_clear(&grammar->end_automaton);
+#endif
+    for (int i = 0; i < len(grammar->start_grammar) && grammar->start_grammar[i]; i++)
+    {
+        if (grammar->start_grammar[i][0]){automaton_add(&grammar->start_automaton,grammar->start_grammar[i],i);}
+        char* end = grammar->end_grammar[i] ? grammar->end_grammar[i] : "";
+#if !defined(__SSE2__)
+        grammar->end_nodes[i] = automaton_add(&grammar->end_automaton,end,i);
+#endif
+        grammar->end_lengths[i] = strlen(end);
+    }
+#if !defined(__SSE2__)
+    automaton_link(&grammar->end_automaton);
+#endif
+    build_char_classes(grammar);
+}
+/* 
+    moves the lexer past the end grammar of the grammar at index returning 
+    1 if it was found or 0 if the source ended before it
+
+    Where SSE2 is available scan_chars jumps to each occurrence of the ends 
+    first character to check for the rest of it, otherwise it steps through 
+    end_automaton (which is only built then)
+*/
+int find_end(LexerType* lexer, int index)
+{
+    GrammarSnapshot* grammar=lexer->grammar;
+    int length=grammar->end_lengths[index];
+    if (length==0){return 1;}
+    int skip=grammar->collect_grammar[index]==0;
+#if defined(__SSE2__)
+    char* end=grammar->end_grammar[index];
+    while (1)
+    {
+        lexer->index=scan_chars(lexer->source,lexer->index,lexer->length,end[0],end[0],'\0');
+        if (skip){lexer->marker=lexer->index;} // nothing skipped needs keeping
+        int left=lexer_fill(lexer,length); // refills the stream if the window's been scanned
+        if (lexer->value=='\0'){return 0;}
+        if (lexer->value!=end[0]){continue;}
+        if (left >= length && memcmp(lexer->source+lexer->index,end,length)==0){lexer_seek(lexer,lexer->index+length);return 1;}
+        lexer_next(lexer);
+    }
+#else
+    int node=0;
+    while (lexer_isrunning(lexer))
+    {
+        if (skip){lexer->marker=lexer->index;} // nothing skipped needs keeping
+        node=grammar->end_automaton.nodes[node].next[(unsigned char)lexer->value];
+        lexer_next(lexer);
+        if (automaton_found(&grammar->end_automaton,node,grammar->end_nodes[index])){return 1;}
+    }
+    return 0;
+#endif
+}
+/* 
+    runs an internal command (one at a time since it can change the grammar) 
+    and publishes what it changed for the lexers from then on (this one 
+    moves onto it at its next unit)
+*/
+void lexer_internal(LexerType* lexer, TokenType* token)
+{
+    pthread_mutex_lock(&grammar_lock);
+    command_parse(token_value(token),internals_keys,internals_values,len(internals_keys));
+    grammar_publish();
+    lexer->stale = lexer->grammar!=atomic_load(&grammar_current);
+    pthread_mutex_unlock(&grammar_lock);
+}
 /* 
-    checks if the grammar is part of the modifiable tokens
+    checks if the grammar is part of the modifiable tokens 
+    (the longest matching start grammar is used) returning 
+    NULL if none of them match
 */
 TokenType* check_grammar(LexerType* lexer)
 {
-    // compare the sequential values of the source from the value to determine the grammar
-    for (int i = 0; i < len(grammar_name); i++)// while(1) // int i=0;i+=1
+    GrammarSnapshot* grammar=lexer->grammar;
+    // walk the start grammars from the value to find the longest match
+    int i=-1,length=0,node=0;
+    for (int j = 0; lexer_fill(lexer,j+1) > j; j++)
     {
-        char* start=start_grammar[i];
-        if (start==NULL){break;} /* ------ since start_grammar has a fixed size and can have NULLs */
-        if (compare_grammar(lexer,start)==0)
+        node=grammar->start_automaton.nodes[node].next[(unsigned char)lexer->source[lexer->index+j]];
+        if (node==0){break;}
+        if (grammar->start_automaton.nodes[node].match!=-1){i=grammar->start_automaton.nodes[node].match;length=j+1;}
+    }
+    if (i==-1){return NULL;}
+    // skip past the start
+    SKIP(length);
+    // input to collect
+    int collect=grammar->collect_grammar[i];
+    lexer->marker = lexer->index;
+    // 0: skip from start to end
+    if (collect==0)
+    {
+        if (!find_end(lexer,i)){HAS_LEXER_ENDED;}
+        return token_init(TOKEN_SKIP, NULL);
+    }
+    // 1: collect from start to end
+    else if (collect==1)
+    {
+        if (!find_end(lexer,i)){HAS_LEXER_ENDED;}
+        TokenType* token = token_span(lexer, i, lexer->marker, lexer->index - grammar->end_lengths[i] - lexer->marker);
+        if (i==INTERNAL){lexer_internal(lexer,token);}
+        return token;
+    }
+    // 3: custom operator from the grammar
+    else if(collect == 2)
+    {
+        return token_init(TOKEN_OPERATOR, grammar->start_grammar[i]);
+    }
+    return token_init(TOKEN_ERROR, NULL);
+}
+/* custom grammar falling back to the builtin token when there's no match */
+TokenType* collect_grammar_token(LexerType* lexer)
+{
+    TokenType* token=check_grammar(lexer);
+    if (token){return token;}
+    return collect_token(lexer);
+}
+/* what tokenizes each CHAR_CLASS */
+TokenType* (*lexer_actions[])(LexerType*) = 
+{
+    collect_end,
+    collect_newline,
+    collect_whitespace,
+    collect_number,
+    collect_id,
+    collect_string,
+    collect_grammar_token,
+    collect_token
+};
+/*
+    The DFA lexer (\-lexer dfa) compiles the whole grammar, i.e. the builtin 
+    tokens, the custom grammar and the consts, into one deterministic finite 
+    automaton so that tokenizing is a single table lookup per character no 
+    matter how many grammars or consts there are.
+
+    The states are:
+
+    start     - state 1 (0 is the dead state)
+    builtin   - whitespace, numbers, newlines, strings and the single character tokens
+    ids       - a trie of the consts inside the id state (so consts are told apart by the state)
+    grammar   - a trie of the start grammars from the start state, each followed 
+                by the KMP automaton searching for its end grammar (its body)
+
+    The longest token wins by remembering the last accepting state passed, except 
+    that once a start grammar has matched the grammar is committed to (like 
+    check_grammar). A start grammar that's the prefix of another one resumes 
+    in its own body if the longer one doesn't match.
+
+    Characters that move the same way in every state share a class so the 
+    transitions are stored as states * classes shorts. Bodies that only leave 
+    on up to three characters (i.e. strings and comments) are skipped through 
+    with scan_chars. It's built for each grammar snapshot in dfa_mode and 
+    can be dumped as a C table (\-lexer dump) to be compiled in with 
+    -DDFA_TABLE='"file"' for ahead of time builds (it's only used if the 
+    grammar hashes the same as the one it was dumped from).
+*/
+enum DFA_ACTION
+{
+    DFA_NONE, // not accepting
+    DFA_SPAN, // the span between skip and trim
+    DFA_NEWLINE,
+    DFA_ID, // interned ids and consts
+    DFA_GRAMMAR // the custom grammar at type
+};
+#define DFA_DEAD 0
+#define DFA_START 1
+#define DFA_MAX_STATES 65536
+#define DFA_ESCAPE (1<<24)
+
+int (*dfa_moves)[256]; // the uncompressed transitions while it's built
+
+#ifdef DFA_TABLE
+#include DFA_TABLE
+#endif
+
+int dfa_state(DfaType* dfa, int action, int type, int skip)
+{
+    if (dfa->length==dfa->capacity)
+    {
+        dfa->capacity = dfa->capacity ? dfa->capacity*2 : 256;
+        dfa_moves = realloc(dfa_moves, dfa->capacity*sizeof(*dfa_moves));
+        dfa->action = realloc(dfa->action, dfa->capacity*sizeof(unsigned char));
+        dfa->type = realloc(dfa->type, dfa->capacity*sizeof(int));
+        dfa->skip = realloc(dfa->skip, dfa->capacity*sizeof(int));
+        dfa->trim = realloc(dfa->trim, dfa->capacity*sizeof(int));
+        dfa->resume = realloc(dfa->resume, dfa->capacity*sizeof(int));
+        dfa->escape = realloc(dfa->escape, dfa->capacity*sizeof(int));
+    }
+    int state=dfa->length++;
+    memset(dfa_moves[state], 0, sizeof(*dfa_moves));
+    dfa->action[state]=action;
+    dfa->type[state]=type;
+    dfa->skip[state]=skip;
+    dfa->trim[state]=0;
+    dfa->resume[state]=0;
+    dfa->escape[state]=0;
+    return state;
+}
+/* 
+    adds the KMP automaton that searches for grammar i's end from 
+    state first (first's transitions have to be empty)
+*/
+void dfa_end(DfaType* dfa, GrammarSnapshot* grammar, int i, int first)
+{
+    char* end=grammar->end_grammar[i];
+    int length=strlen(end), skip=strlen(grammar->start_grammar[i]);
+    int* states=malloc((length+1)*sizeof(int));
+    states[0]=first;
+    for (int k = 1; k < length; k++){states[k]=dfa_state(dfa,DFA_NONE,i,skip);}
+    states[length]=dfa_state(dfa,DFA_GRAMMAR,i,skip);
+    dfa->trim[states[length]]=length;
+    // states[k] has matched k characters of the end and x is how many a mismatch keeps (the null byte is dead)
+    for (int c = 1; c < 256; c++){dfa_moves[first][c]=first;}
+    dfa_moves[first][(unsigned char)end[0]]=states[1];
+    for (int k = 1, x = 0; k < length; k++)
+    {
+        for (int c = 1; c < 256; c++){dfa_moves[states[k]][c]=dfa_moves[states[x]][c];}
+        dfa_moves[states[k]][(unsigned char)end[k]]=states[k+1];
+        int next=dfa_moves[states[x]][(unsigned char)end[k]];
+        x = next==first ? 0 : next-states[1]+1; // the states after the first are in order
+    }
+    free(states);
+}
+/* the start and end grammar of i are both skipped or collected */
+#define HAS_BODY(i) ((grammar->collect_grammar[i]==0 || grammar->collect_grammar[i]==1) && grammar->end_grammar[i] && grammar->end_grammar[i][0])
+/* 
+    compiles the grammar into dfa (build_grammar_automata has to 
+    have run on it first for the character tables)
+*/
+void build_dfa(DfaType* dfa, GrammarSnapshot* grammar)
+{
+#ifdef DFA_TABLE
+    if (grammar->hash==DFA_TABLE_HASH)
+    {
+        memcpy(dfa->classes, dfa_table_classes, sizeof(dfa->classes));
+        dfa->class_count=DFA_TABLE_CLASSES;
+        dfa->length=DFA_TABLE_STATES;
+        dfa->next=dfa_table_next;
+        dfa->action=dfa_table_action;
+        dfa->type=dfa_table_type;
+        dfa->skip=dfa_table_skip;
+        dfa->trim=dfa_table_trim;
+        dfa->resume=dfa_table_resume;
+        dfa->escape=dfa_table_escape;
+        dfa->fixed=1;
+        return;
+    }
+#endif
+    dfa->length=0;
+    dfa_state(dfa,DFA_NONE,0,0); // dead
+    dfa_state(dfa,DFA_NONE,0,0); // start
+    /* the start grammars trie (the bodies are added once it's complete) */
+    int ends[MAX_GRAMMAR_SIZE];
+    for (int i = 0; i < len(grammar->start_grammar) && grammar->start_grammar[i]; i++)
+    {
+        unsigned char* start=(unsigned char*)grammar->start_grammar[i];
+        ends[i]=DFA_DEAD;
+        if (grammar->char_class[start[0]]!=CLASS_GRAMMAR){continue;} // can't start a grammar
+        int state=DFA_START;
+        for (int j = 0; start[j]; j++)
         {
-            // skip past the start
-            SKIP(start);
-            char* end=end_grammar[i];
-            // input to collect
-            int collect=collect_grammar[i];
-            // 0: skip from start to end
-            if (collect==0)
+            if (dfa_moves[state][start[j]]==DFA_DEAD)
             {
-                char* value=NULL; // since the macro uses 'value'
-                while (compare_grammar(lexer,end)){HAS_LEXER_ENDED;lexer_next(lexer);}
-                SKIP(end);
-                return token_init(TOKEN_SKIP, NULL);
+                // the first character falls back to its builtin token
+                int next = j ? dfa_state(dfa,DFA_NONE,0,0) : dfa_state(dfa,char_token[start[j]]==TOKEN_ERROR ? DFA_NONE : DFA_SPAN,char_token[start[j]],0);
+                dfa_moves[state][start[j]]=next;
             }
-            // 1: collect from start to end
-            else if (collect==1)
+            state=dfa_moves[state][start[j]];
+        }
+        ends[i]=state;
+    }
+    int* matches=calloc(dfa->length, sizeof(int));
+    for (int i = 0; i < len(grammar->start_grammar) && grammar->start_grammar[i]; i++)
+    {
+        if (ends[i]!=DFA_DEAD && matches[ends[i]]==0){matches[ends[i]]=i+1;} // the first one added keeps duplicates
+    }
+    int trie_length=dfa->length;
+    for (int state = DFA_START+1; state < trie_length; state++)
+    {
+        int i=matches[state]-1;
+        if (i==-1){continue;}
+        dfa->skip[state]=strlen(grammar->start_grammar[i]);
+        dfa->type[state]=i;
+        if (!HAS_BODY(i)){dfa->action[state]=DFA_GRAMMAR;continue;}
+        // a start grammar that others carry on from resumes in its own body
+        int leaf=1;
+        for (int c = 0; c < 256; c++){if (dfa_moves[state][c]){leaf=0;break;}}
+        dfa->action[state]=DFA_NONE;
+        if (leaf){dfa_end(dfa,grammar,i,state);}
+        else
+        {
+            int body=dfa_state(dfa,DFA_NONE,i,dfa->skip[state]);
+            dfa_end(dfa,grammar,i,body);
+            dfa->resume[state]=body;
+            dfa->skip[state]=0;
+        }
+    }
+    free(matches);
+    /* the builtin tokens */
+    int newline=dfa_state(dfa,DFA_NEWLINE,TOKEN_NEWLINE,0);
+    int whitespace=dfa_state(dfa,DFA_SPAN,TOKEN_WHITESPACE,0);
+    int number=dfa_state(dfa,DFA_SPAN,TOKEN_NUMBER,0);
+    int id=dfa_state(dfa,DFA_ID,TOKEN_ID,0);
+    for (int c = 0; c < 256; c++)
+    {
+        if (is_space(c)){dfa_moves[whitespace][c]=whitespace;}
+        if (is_digit(c)){dfa_moves[number][c]=number;}
+        if (is_alnum(c)){dfa_moves[id][c]=id;}
+    }
+    for (int c = 1; c < 256; c++)
+    {
+        switch (grammar->char_class[c])
+        {
+            case CLASS_NEWLINE: dfa_moves[DFA_START][c]=newline;break;
+            case CLASS_WHITESPACE: dfa_moves[DFA_START][c]=whitespace;break;
+            case CLASS_NUMBER: dfa_moves[DFA_START][c]=number;break;
+            case CLASS_ID: dfa_moves[DFA_START][c]=id;break;
+            case CLASS_TOKEN:
+                if (char_token[c]!=TOKEN_ERROR){dfa_moves[DFA_START][c]=dfa_state(dfa,DFA_SPAN,char_token[c],0);}
+                break;
+            // jumps between the quotes and backslashes (backslashes allow for \" and \')
+            case CLASS_STRING:
             {
-                char* value = calloc(1, sizeof(char));
-                value[0] = '\0';
-                char* str;
-                while (compare_grammar(lexer,end))
-                {
-                    HAS_LEXER_ENDED;
-                    str = char_to_string(lexer);
-                    value = realloc(value, (strlen(value) + strlen(str) + 1) * sizeof(char));
-                    strcat(value, str);
-                }
-                SKIP(end);
-                if (i==INTERNAL){command_parse(value,internals_keys,internals_values,len(internals_keys));}
-                return token_init(i, value);
+                int body=dfa_state(dfa,DFA_NONE,TOKEN_STRING,1);
+                int escape=dfa_state(dfa,DFA_NONE,TOKEN_STRING,1);
+                int end=dfa_state(dfa,DFA_SPAN,TOKEN_STRING,1);
+                dfa->trim[end]=1;
+                for (int k = 1; k < 256; k++){dfa_moves[body][k]=body;dfa_moves[escape][k]=body;}
+                dfa_moves[body][c]=end;
+                dfa_moves[body]['\\']=escape;
+                dfa_moves[DFA_START][c]=body;
+                break;
             }
-            // 3: custom operator from the grammar
-            else if(collect == 2)
+        }
+    }
+    /* the consts trie inside the id state */
+    for (int i = 0; i < len(consts) && consts[i]; i++)
+    {
+        unsigned char* constant=(unsigned char*)consts[i];
+        if (grammar->char_class[constant[0]]!=CLASS_ID){continue;}
+        int state=DFA_START;
+        for (int j = 0; constant[j]; j++)
+        {
+            if (!is_alnum(constant[j])){state=DFA_DEAD;break;} // can't be an id
+            int next=dfa_moves[state][constant[j]];
+            if (next==id)
             {
-                return token_init(TOKEN_OPERATOR, start); // +1 for 0 based indexing
+                next=dfa_state(dfa,DFA_ID,TOKEN_ID,0);
+                for (int c = 0; c < 256; c++){if (is_alnum(c)){dfa_moves[next][c]=id;}}
+                dfa_moves[state][constant[j]]=next;
             }
+            state=next;
         }
+        if (state!=DFA_DEAD){dfa->type[state]=TOKEN_CONST;}
     }
-    return token_init(TOKEN_ERROR, NULL);
+    if (dfa->length > DFA_MAX_STATES)
+    {
+        printf("Error: The grammar needs too many states for the dfa lexer (%d). Using the hand lexer.\n",dfa->length);
+        dfa_mode=0;
+        dfa_free(dfa);
+        return;
+    }
+    /* bodies that leave on at most three characters */
+    for (int state = 0; state < dfa->length; state++)
+    {
+        if (dfa->action[state]!=DFA_NONE || dfa->skip[state]==0){continue;}
+        int escapes[3], count=0;
+        for (int c = 0; c < 256 && count <= 3; c++){if (dfa_moves[state][c]!=state){if (count < 3){escapes[count]=c;}count++;}}
+        if (count==0 || count > 3){continue;}
+        for (int k = count; k < 3; k++){escapes[k]=escapes[0];}
+        dfa->escape[state]=DFA_ESCAPE|escapes[0]|escapes[1]<<8|escapes[2]<<16;
+    }
+    /* characters that move the same way in every state share a class */
+    int representative[256];
+    dfa->class_count=0;
+    for (int c = 0; c < 256; c++)
+    {
+        int k=0;
+        for (; k < dfa->class_count; k++)
+        {
+            int same=1;
+            for (int state = 0; state < dfa->length && same; state++){same=dfa_moves[state][c]==dfa_moves[state][representative[k]];}
+            if (same){break;}
+        }
+        if (k==dfa->class_count){representative[dfa->class_count++]=c;}
+        dfa->classes[c]=k;
+    }
+    dfa->next=realloc(dfa->next, dfa->length*dfa->class_count*sizeof(unsigned short));
+    for (int state = 0; state < dfa->length; state++)
+    {
+        for (int k = 0; k < dfa->class_count; k++){dfa->next[state*dfa->class_count+k]=dfa_moves[state][representative[k]];}
+    }
+}
+void dfa_free(DfaType* dfa)
+{
+    if (!dfa->fixed){free(dfa->next);free(dfa->action);free(dfa->type);free(dfa->skip);free(dfa->trim);free(dfa->resume);free(dfa->escape);}
+    memset(dfa, 0, sizeof(DfaType));
+}
+/* writes out an int array as a C initializer */
+#define DUMP_ARRAY(kind,name,array,length) \
+fprintf(file,"%s %s[]={",kind,name); \
+for (int i = 0; i < length; i++){fprintf(file,"%s%d",i ? (i%32 ? "," : ",\n") : "",array[i]);} \
+fprintf(file,"};\n");
+
+/* writes the dfa as C tables that can be compiled in with DFA_TABLE */
+void dfa_dump(FILE* file)
+{
+    GrammarSnapshot* grammar=grammar_acquire();
+    DfaType tables={0}, *dfa=&tables; // it's built even if the lexer's not in dfa_mode
+    build_dfa(dfa,grammar);
+    fprintf(file,"/* dfa lexer tables written by \\-lexer dump (only used with the grammar they're from) */\n");
+    fprintf(file,"#define DFA_TABLE_HASH 0x%016llxull\n",grammar->hash);
+    fprintf(file,"#define DFA_TABLE_STATES %d\n",dfa->length);
+    fprintf(file,"#define DFA_TABLE_CLASSES %d\n",dfa->class_count);
+    DUMP_ARRAY("unsigned char","dfa_table_classes",dfa->classes,256)
+    DUMP_ARRAY("unsigned short","dfa_table_next",dfa->next,dfa->length*dfa->class_count)
+    DUMP_ARRAY("unsigned char","dfa_table_action",dfa->action,dfa->length)
+    DUMP_ARRAY("int","dfa_table_type",dfa->type,dfa->length)
+    DUMP_ARRAY("int","dfa_table_skip",dfa->skip,dfa->length)
+    DUMP_ARRAY("int","dfa_table_trim",dfa->trim,dfa->length)
+    DUMP_ARRAY("int","dfa_table_resume",dfa->resume,dfa->length)
+    DUMP_ARRAY("int","dfa_table_escape",dfa->escape,dfa->length)
+    dfa_free(dfa);
+    grammar_release(grammar);
+}
+/* 
+    runs the dfa from the marker for the longest token (falling 
+    back to the collectors for the end and invalid characters)
+*/
+TokenType* dfa_token(LexerType* lexer)
+{
+    GrammarSnapshot* grammar=lexer->grammar;
+    DfaType* dfa=&grammar->dfa;
+    int state=DFA_START, last=0, last_length=0, resume=0, resume_length=0;
+    while (1)
+    {
+        int escape=dfa->escape[state];
+        if (escape){lexer->index=scan_chars(lexer->source,lexer->index,lexer->length,escape&255,escape>>8&255,escape>>16&255);}
+        if (lexer->index >= lexer->length)
+        {
+            // the next line of a terminal is waited on only when it's needed
+            if (lexer->interactive && lexer->index > 0 && lexer->source[lexer->index-1] == '\n' && (state==DFA_START || state==last)){break;}
+            if (!lexer_fill(lexer, 1)){break;}
+        }
+        int next=dfa->next[state*dfa->class_count+dfa->classes[(unsigned char)lexer->source[lexer->index]]];
+        if (next==DFA_DEAD)
+        {
+            if (last || !resume){break;}
+            // the longer start grammar didn't match
+            state=resume;
+            lexer->index=lexer->marker+resume_length;
+            resume=0;
+            continue;
+        }
+        state=next;
+        lexer->index++;
+        if (dfa->resume[state]){resume=dfa->resume[state];resume_length=lexer->index-lexer->marker;last=0;}
+        else if (dfa->action[state]){last=state;last_length=lexer->index-lexer->marker;}
+        else if (dfa->skip[state]){last=0;resume=0;} // committed to a body
+    }
+    if (last==0)
+    {
+        // the source ended in a string or grammars body
+        if (dfa->skip[state])
+        {
+            int start=lexer->marker+dfa->skip[state];
+            lexer_seek(lexer, lexer->index);
+            return token_span(lexer, TOKEN_ERROR, start, lexer->index - start);
+        }
+        lexer_seek(lexer, lexer->marker);
+        return lexer->value == '\0' ? collect_end(lexer) : collect_token(lexer);
+    }
+    lexer_seek(lexer, lexer->marker + last_length);
+    int start=lexer->marker+dfa->skip[last], length=last_length-dfa->skip[last]-dfa->trim[last], i=dfa->type[last];
+    switch (dfa->action[last])
+    {
+        case DFA_NEWLINE: return token_init(TOKEN_NEWLINE, "\\n");
+        case DFA_ID:
+        {
+            TokenType* token = token_span(lexer, i, start, length);
+            token->symbol = symbol_intern(lexer->source + start, length);
+            return token;
+        }
+        case DFA_GRAMMAR:
+            if (grammar->collect_grammar[i]==0){return token_init(TOKEN_SKIP, NULL);}
+            if (grammar->collect_grammar[i]==2){return token_init(TOKEN_OPERATOR, grammar->start_grammar[i]);}
+            if (grammar->collect_grammar[i]==1)
+            {
+                TokenType* token = token_span(lexer, i, start, length);
+                if (i==INTERNAL){lexer_internal(lexer,token);}
+                return token;
+            }
+            return token_init(TOKEN_ERROR, NULL);
+    }
+    return token_span(lexer, i, start, length);
+}
+/* 
+    Tokenizes based on a single character; it will use look 
+    aheads to collect multiple characters if necessary
+*/
+TokenType* next_token(LexerType* lexer)
+{
+    // a lexer that ran an internal command moves on before the next unit (so a parser never sees it change)
+    if (lexer->stale && lexer->tokens->count==0){lexer_refresh(lexer);}
+    lexer->marker = lexer->index;
+    if (lexer->grammar->dfa.length){return dfa_token(lexer);}
+    return lexer_actions[lexer->grammar->char_class[(unsigned char)lexer->value]](lexer);
+}
+/* empties the buffer for a new unit */
+void token_buffer_clear(TokenBuffer* buffer)
+{
+    buffer->count=0;
+    buffer->cursor=0;
+    buffer->unit++;
+}
+/*
+    Tokenizes a whole line onto the end of the buffer in one go (up to its 
+    newline, the end of the source, or an error) returning how many tokens it has
+*/
+int lex_into(LexerType* lexer, TokenBuffer* buffer)
+{
+    unsigned long long began = profiling ? profile_clock() : 0;
+    while (1)
+    {
+        int offset=lexer->offset+lexer->index;
+        TokenType* token=next_token(lexer);
+        if (buffer->count==buffer->capacity)
+        {
+            buffer->capacity = buffer->capacity ? buffer->capacity*2 : 256;
+            buffer->types = realloc(buffer->types, buffer->capacity * sizeof(int));
+            buffer->offsets = realloc(buffer->offsets, buffer->capacity * sizeof(int));
+            buffer->lengths = realloc(buffer->lengths, buffer->capacity * sizeof(int));
+            buffer->symbols = realloc(buffer->symbols, buffer->capacity * sizeof(int));
+            buffer->tokens = realloc(buffer->tokens, buffer->capacity * sizeof(TokenType*));
+        }
+        int i=buffer->count++;
+        buffer->types[i]=token->type;
+        buffer->offsets[i]=offset;
+        buffer->lengths[i]=lexer->offset+lexer->index-offset;
+        buffer->symbols[i]=token->symbol;
+        buffer->tokens[i]=token;
+        if (token->type==TOKEN_NEWLINE || token->type==TOKEN_EOF || token->type==TOKEN_ERROR){break;}
+        // i.e. comments and internal commands that end with the newline
+        if (lexer->index > 0 && lexer->source[lexer->index-1]=='\n'){break;}
+    }
+    if (began)
+    {
+        unsigned long long cycles=profile_clock()-began;
+        lex_cycles+=cycles;
+        profile_add(&profile_phases[PHASE_LEX],cycles);
+    }
+    return buffer->count;
 }
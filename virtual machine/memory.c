@@ -19,48 +19,422 @@
     All frames have:
     1. its full scope name
     2. dictionary of locals
+
+    The frames of calls aren't put in the globals, they're on the 
+    frame stack (see Call frames) with their locals in slots.
 */
 #include "lexer.c"
 
 /*********************
 *   Frame creation   *
 *********************/
-typedef struct FRAME_STRUCT
-{
-    char* frame_name;
-    HashTable* locals; // can contain frames in here as well
-} FrameType;
+typedef CallFrame FrameType; // frames are on the frame stack (see frame_init in Call frames)
 
 #define MAX_THREADS 10
 FrameType* Threads[MAX_THREADS];
 HashTable* globals; // globals has access to everything user defined
+/*********************
+*       Values       *
+*********************/
+/*
+    A value is 64 bits that are either a double or (in the bits of a 
+    NaN no arithmetic makes) a tag with its payload, so numbers, bools, 
+    None and interned strings are never allocated:
+
+     - TAG_INT       a 48 bit integer (it becomes a double past that)
+     - TAG_BOOL      0 or 1
+     - TAG_NONE
+     - TAG_STRING    the id of an interned string (string constants up to SMALL_STRING long)
+     - TAG_OBJECT    a pointer to an object, which starts with its type
+     - TAG_UNDEFINED what's loaded when nothing's been stored
 
-FrameType* frame_init(char* name)
+    Objects are either in the unit_arena (made while evaluating), owned 
+    by the code they're a constant of, or on the heap (once stored) where 
+    the garbage collector frees them once nothing can reach them.
+*/
+typedef uint64_t Value;
+
+enum VALUE_TAGS {TAG_DOUBLE, TAG_INT, TAG_BOOL, TAG_NONE, TAG_STRING, TAG_OBJECT, TAG_UNDEFINED};
+#define TAG_BITS(tag) (0xfff8000000000000ull | (uint64_t)(tag) << 48)
+#define VALUE_TAG(value) ((value) >= 0xfff9000000000000ull ? (int)((value) >> 48 & 7) : TAG_DOUBLE)
+#define PAYLOAD(value) ((value) & 0xffffffffffffull)
+#define IS_INT(value) (((value) >> 48)==(TAG_BITS(TAG_INT) >> 48))
+#define IS_DOUBLE(value) ((value) < 0xfff9000000000000ull)
+#define IS_OBJECT(value) (((value) >> 48)==(TAG_BITS(TAG_OBJECT) >> 48))
+
+#define INT_MAX48 ((1ll << 47)-1)
+#define INT_MIN48 (-(1ll << 47))
+#define INT_VALUE(integer) (TAG_BITS(TAG_INT) | PAYLOAD((uint64_t)(integer)))
+#define AS_INT(value) ((int64_t)((value) << 16) >> 16)
+#define BOOL_VALUE(boolean) (TAG_BITS(TAG_BOOL) | ((boolean)!=0))
+#define NONE_VALUE TAG_BITS(TAG_NONE)
+#define UNDEFINED TAG_BITS(TAG_UNDEFINED)
+#define STRING_VALUE(symbol) (TAG_BITS(TAG_STRING) | (uint64_t)(symbol))
+#define OBJECT_VALUE(object) (TAG_BITS(TAG_OBJECT) | (uint64_t)(uintptr_t)(object))
+#define AS_OBJECT(value) ((ObjectType*)(uintptr_t)PAYLOAD(value))
+#define AS_STRING(value) ((StringObject*)AS_OBJECT(value))
+#define SMALL_STRING 32
+
+Value double_value(double number)
 {
-    FrameType* frame = calloc(1, sizeof(struct FRAME_STRUCT));
-    frame->frame_name = name;
-    frame->locals = NULL;
-    table_set(globals, name, frame);
-    return frame;
+    Value value;
+    if (number!=number){return 0x7ff8000000000000ull;} // so a NaN is never mistaken for a tag
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+double as_double(Value value)
+{
+    if (IS_INT(value)){return AS_INT(value);}
+    double number;
+    memcpy(&number, &value, sizeof(double));
+    return number;
+}
+/* an int if it fits otherwise a double */
+Value int_value(int64_t integer){return integer >= INT_MIN48 && integer <= INT_MAX48 ? INT_VALUE(integer) : double_value(integer);}
+
+enum OBJECT_TYPES {OBJECT_STRING};
+enum OBJECT_OWNERS {OWNER_HEAP, OWNER_ARENA, OWNER_CODE};
+typedef struct OBJECT_STRUCT
+{
+    int type;
+    int owner;
+    int marked; // the collection it was last reached in (heap objects only)
+    struct OBJECT_STRUCT* next; // on the heap list
+} ObjectType;
+typedef struct STRING_OBJECT_STRUCT
+{
+    ObjectType header;
+    int length;
+    char chars[]; // null terminated
+} StringObject;
+
+ObjectType* gc_objects=NULL; // every heap object (the newest first)
+ObjectType** gc_cursor=&gc_objects; // the link the sweep is up to
+int gc_epoch=0; // flips each collection so nothing has to be unmarked
+
+/* objects on the heap are put on the heap list for the collector */
+void* gc_alloc(int size)
+{
+    ObjectType* object=slab_alloc(size);
+    object->owner=OWNER_HEAP;
+    object->marked=gc_epoch; // so one made while sweeping isn't swept
+    object->next=gc_objects;
+    gc_objects=object;
+    gc_allocated+=size;
+    gc_live+=size;
+    gc_object_count++;
+    return object;
+}
+/* chars can be NULL for the caller to fill them in */
+Value string_object(char* chars, int length, int owner)
+{
+    int size=sizeof(StringObject)+length+1;
+    StringObject* string = owner==OWNER_ARENA ? arena_alloc(&unit_arena, size) : owner==OWNER_HEAP ? gc_alloc(size) : malloc(size);
+    string->header.type=OBJECT_STRING;
+    string->header.owner=owner;
+    string->length=length;
+    if (chars){memcpy(string->chars, chars, length);}
+    string->chars[length]='\0';
+    return OBJECT_VALUE(string);
 }
-void free_frame(FrameType* frame)
+int object_size(ObjectType* object)
 {
-    free(frame->locals);
-    table_delete(globals, frame->frame_name);
-    free(frame);
+    if (object->type==OBJECT_STRING){return sizeof(StringObject)+((StringObject*)object)->length+1;}
+    return sizeof(ObjectType);
+}
+/* an object of its own on the heap (immediates are already copies) */
+Value value_copy(Value value)
+{
+    if (!IS_OBJECT(value)){return value;}
+    int size=object_size(AS_OBJECT(value));
+    ObjectType* object=gc_alloc(size);
+    object->type=AS_OBJECT(value)->type;
+    memcpy(object+1, AS_OBJECT(value)+1, size-sizeof(ObjectType));
+    return OBJECT_VALUE(object);
+}
+/* what's stored has to outlive the unit_arena and the code (heap objects are shared, they're never changed) */
+Value value_promote(Value value){return IS_OBJECT(value) && AS_OBJECT(value)->owner!=OWNER_HEAP ? value_copy(value) : value;}
+/* the value as text (buffer is used for numbers) */
+char* value_string(Value value, char* buffer, int size)
+{
+    switch (VALUE_TAG(value))
+    {
+        case TAG_DOUBLE: snprintf(buffer, size, "%.15g", as_double(value)); return buffer;
+        case TAG_INT: snprintf(buffer, size, "%lld", (long long)AS_INT(value)); return buffer;
+        case TAG_BOOL: return PAYLOAD(value) ? "True" : "False";
+        case TAG_NONE: return "None";
+        case TAG_STRING: return symbol_name(PAYLOAD(value));
+        case TAG_OBJECT: return AS_OBJECT(value)->type==OBJECT_STRING ? AS_STRING(value)->chars : "<object>";
+    }
+    return "<undefined>";
+}
+/* the value of a constant token */
+Value constant_value(char* text, int type, int owner)
+{
+    if (type==TOKEN_NUMBER)
+    {
+        char* end;
+        long long integer=strtoll(text, &end, 10);
+        if (*end=='\0' && integer >= INT_MIN48 && integer <= INT_MAX48){return INT_VALUE(integer);}
+        return double_value(strtod(text, NULL));
+    }
+    if (type==TOKEN_CONST)
+    {
+        if (strcmp(text,"True")==0){return BOOL_VALUE(1);}
+        if (strcmp(text,"False")==0){return BOOL_VALUE(0);}
+        if (strcmp(text,"None")==0){return NONE_VALUE;}
+    }
+    int length=strlen(text);
+    if (length <= SMALL_STRING){return STRING_VALUE(symbol_intern(text, length));}
+    return string_object(text, length, owner);
 }
 /* 
     shorthand functions
+
+    Note: values made while lexing or parsing live in the unit_arena 
+    and have to be promoted before being stored
 */
-void store(char* key,void* value){table_set(globals, key,value);}
+void store(char* key,void* value){table_set(globals, key,value);} // keys are interned so they outlive the unit_arena
 void* load(char* key){return table_get(globals, key);}
 void del(char* key){table_delete(globals, key);}
-void copy(char* key)
+/* Values by interned id (what was there is returned) */
+Value load_symbol(int symbol)
+{
+    Node* node=globals->table[hash(symbol)];
+    while (node != NULL && node->symbol != symbol){node=node->next;}
+    return node ? node->data : UNDEFINED;
+}
+Value store_symbol(int symbol,Value value)
+{
+    // replaced in place rather than shadowed
+    Node* node=globals->table[hash(symbol)];
+    while (node != NULL && node->symbol != symbol){node=node->next;}
+    if (node == NULL){table_set_symbol(globals, symbol, NULL);node=globals->table[hash(symbol)];node->data=value;return UNDEFINED;}
+    Value old=node->data;
+    node->data=value;
+    return old;
+}
+Value del_symbol(int symbol)
+{
+    Value value=load_symbol(symbol);
+    table_delete_symbol(globals, symbol);
+    return value;
+}
+/*
+    Inline caches
+
+    Each LOAD and STORE in the code has one that remembers the node 
+    its symbol was found at (or that it wasn't) and the globals version 
+    it was looked up at, so it's only looked up again once a node has 
+    been added or removed. Nodes are never moved otherwise.
+*/
+typedef struct INLINE_CACHE_STRUCT
+{
+    Node* node;
+    unsigned int version;
+} InlineCache;
+
+static inline Node* cached_node(int symbol, InlineCache* cache)
+{
+    if (cache->version!=globals->version)
+    {
+        Node* node=globals->table[hash(symbol)];
+        while (node != NULL && node->symbol != symbol){node=node->next;}
+        cache->node=node;
+        cache->version=globals->version;
+    }
+    return cache->node;
+}
+Value load_cached(int symbol, InlineCache* cache)
+{
+    Node* node=cached_node(symbol,cache);
+    return node ? node->data : UNDEFINED;
+}
+Value store_cached(int symbol, Value value, InlineCache* cache)
+{
+    Node* node=cached_node(symbol,cache);
+    if (node == NULL){return store_symbol(symbol,value);}
+    Value old=node->data;
+    node->data=value;
+    return old;
+}
+/* a copy of the keys value that's its own (objects are copied by their size not the pointers) */
+Value copy(char* key)
+{
+    int symbol=symbol_lookup(key, strlen(key));
+    return symbol ? value_copy(load_symbol(symbol)) : UNDEFINED;
+}
+/*********************
+*    Call frames     *
+*********************/
+/*
+    A functions body is compiled with a LocalScope that gives each 
+    local a slot (in the order they're first seen) so a call only has 
+    to push a frame with that many slots on the frame stack (see 
+    utils.c) and its locals are indexed rather than hashed. 
+
+    Locals that are only known by name at run time (i.e. from a 
+    debugger or eval) go in the frames table instead.
+*/
+typedef struct LOCAL_SCOPE_STRUCT
+{
+    int* symbols; // the symbol in each slot
+    int count;
+    int capacity;
+} LocalScope;
+
+/* the locals slot (giving it the next one if it doesn't have one) */
+int local_slot(LocalScope* scope, int symbol)
+{
+    for (int i = 0; i < scope->count; i++){if (scope->symbols[i]==symbol){return i;}}
+    if (scope->count==scope->capacity)
+    {
+        scope->capacity = scope->capacity ? scope->capacity*2 : 8;
+        scope->symbols = realloc(scope->symbols, scope->capacity*sizeof(int));
+    }
+    scope->symbols[scope->count]=symbol;
+    return scope->count++;
+}
+void scope_free(LocalScope* scope){free(scope->symbols);memset(scope, 0, sizeof(LocalScope));}
+
+/* pushes the frame for a call (NULL if the stack's full i.e. the recursion is too deep) */
+CallFrame* frame_push(int symbol, int slot_count)
+{
+    if (frame_depth==FRAME_STACK_SIZE || slot_top+slot_count > SLOT_STACK_SIZE){printf("Recursion Error: Too many frames\n");return NULL;}
+    CallFrame* frame=&frame_stack[frame_depth++];
+    frame->symbol=symbol;
+    frame->slots=slot_stack+slot_top;
+    frame->slot_count=slot_count;
+    slot_top+=slot_count;
+    for (int i = 0; i < slot_count; i++){frame->slots[i]=UNDEFINED;}
+    return frame;
+}
+/* pops the innermost frame (its locals are collected once nothing else has them) */
+void frame_pop()
+{
+    CallFrame* frame=&frame_stack[--frame_depth];
+    if (frame->dynamic_count)
+    {
+        table_clear(frame->dynamic);
+        frame->dynamic_count=0;
+    }
+    slot_top-=frame->slot_count;
+}
+/* pushes a frame by name (it has no slots so its locals are all by name) */
+FrameType* frame_init(char* name){return frame_push(symbol_intern(name, strlen(name)), 0);}
+/* pops the frame (only the innermost one can be) */
+void free_frame(FrameType* frame){if (frame_depth && frame==&frame_stack[frame_depth-1]){frame_pop();}}
+Value local_load(CallFrame* frame, int slot){return frame->slots[slot];}
+/* what was there is returned */
+Value local_store(CallFrame* frame, int slot, Value value)
+{
+    Value old=frame->slots[slot];
+    frame->slots[slot]=value;
+    return old;
+}
+/* by name (the slots from the scope first then the table) */
+Value local_lookup(CallFrame* frame, LocalScope* scope, int symbol)
+{
+    for (int i = 0; i < scope->count; i++){if (scope->symbols[i]==symbol){return frame->slots[i];}}
+    if (frame->dynamic_count==0){return UNDEFINED;}
+    Node* node=frame->dynamic->table[hash(symbol)];
+    while (node != NULL && node->symbol != symbol){node=node->next;}
+    return node ? node->data : UNDEFINED;
+}
+Value local_set(CallFrame* frame, LocalScope* scope, int symbol, Value value)
+{
+    for (int i = 0; i < scope->count; i++){if (scope->symbols[i]==symbol){return local_store(frame,i,value);}}
+    if (frame->dynamic==NULL){frame->dynamic=table_init();}
+    Node* node=frame->dynamic->table[hash(symbol)];
+    while (node != NULL && node->symbol != symbol){node=node->next;}
+    if (node == NULL)
+    {
+        table_set_symbol(frame->dynamic, symbol, NULL);
+        frame->dynamic->table[hash(symbol)]->data=value;
+        frame->dynamic_count++;
+        return UNDEFINED;
+    }
+    Value old=node->data;
+    node->data=value;
+    return old;
+}
+/*********************
+* Garbage collector  *
+*********************/
+/*
+    Marks what's reachable from the roots with the current epoch and 
+    sweeps what isn't off the heap list (see Garbage collector in utils.c).
+*/
+static inline void gc_mark(Value value)
+{
+    if (!IS_OBJECT(value)){return;}
+    ObjectType* object=AS_OBJECT(value);
+    if (object->owner!=OWNER_HEAP || object->marked==gc_epoch){return;}
+    object->marked=gc_epoch;
+    gc_marked+=object_size(object);
+}
+/* globals also has the frames in it (they aren't NaN-boxed so they're never taken as objects) */
+void gc_mark_table(HashTable* table)
+{
+    for (int i = 0; i < TABLE_SIZE; i++)
+    {
+        for (Node* node = table->table[i]; node != NULL; node = node->next){gc_mark(node->data);}
+    }
+}
+void gc_mark_roots()
+{
+    gc_mark_table(globals);
+    for (int i = 0; i < frame_depth; i++)
+    {
+        for (int j = 0; j < frame_stack[i].slot_count; j++){gc_mark(frame_stack[i].slots[j]);}
+        if (frame_stack[i].dynamic_count){gc_mark_table(frame_stack[i].dynamic);}
+    }
+}
+/* frees up to count unmarked objects further down the list (returns 1 once it's at the end) */
+int gc_sweep(long long count)
+{
+    while (*gc_cursor != NULL && count--)
+    {
+        ObjectType* object=*gc_cursor;
+        if (object->marked==gc_epoch){gc_cursor=&object->next;continue;}
+        *gc_cursor=object->next;
+        int size=object_size(object);
+        gc_live-=size;
+        gc_freed+=size;
+        gc_object_count--;
+        slab_free(object, size);
+    }
+    if (*gc_cursor != NULL){return 0;}
+    gc_cursor=&gc_objects;
+    gc_sweeping=0;
+    return 1;
+}
+void gc_collect()
+{
+    if (gc_sweeping){gc_sweep(LLONG_MAX);}
+    gc_epoch^=1;
+    gc_marked=0;
+    gc_mark_roots();
+    gc_allocated=0;
+    gc_sweeping=1;
+    gc_collections++;
+}
+/* 
+    called between statements (the only time the roots are all there is) 
+    to collect or carry on sweeping
+*/
+void gc_safepoint()
 {
-    void* value = load(key);
-    void* value_copy = malloc(sizeof(value));
-    memcpy(value_copy, value, sizeof(value));
-    store(key, value_copy); // need a different way of storing
+    long long trigger=gc_marked*gc_growth/100;
+    if (trigger < gc_threshold){trigger=gc_threshold;}
+    if (!gc_requested && !gc_sweeping && gc_allocated < trigger){return;}
+    long long start=gc_clock();
+    if (gc_requested){gc_collect();gc_sweep(LLONG_MAX);gc_requested=0;}
+    else if (gc_sweeping){gc_sweep(gc_step);}
+    else{gc_collect();gc_sweep(gc_step);}
+    long long pause=gc_clock()-start;
+    gc_pause_total+=pause;
+    if (pause > gc_pause_max){gc_pause_max=pause;}
 }
 
 // a scope is a name of a frame
@@ -30,137 +30,223 @@
 /*******************************************
 *   Defining the form matcher and parser   *
 *******************************************/
+#define ERROR(error) form->type=SYNTAX_ERROR;form->message=error;return form;
 
-int isform(int token,int form)
+/*
+    gets the next token from the lexers token buffer (lexing the
+    next line onto it if a form carries on past the ones it has)
+*/
+TokenType* parser_next(LexerType* lexer)
 {
-    if (form==ABSTRACT_FORM){return -1;}
-    return (token==form);
+    TokenBuffer* buffer=lexer->tokens;
+    if (buffer->cursor==buffer->count){lex_into(lexer,buffer);}
+    return buffer->tokens[buffer->cursor++];
 }
+/* checks if there are tokens left to parse */
+int parser_isrunning(LexerType* lexer){return lexer->tokens->cursor < lexer->tokens->count || lexer_isrunning(lexer);}
 
-/*********************************************
-*  Go through all the forms to find a match  *
-*********************************************/
-
-#define INDICATOR matches++;if (matches == 2){i++;prev_index=i;break;}
-#define BREAK(index) flag=index;break;
-#define ERROR(error) form->type=SYNTAX_ERROR;form->message=error;return form;
-
+FormType* match_form(LexerType* lexer);
+__thread int form_depth=0; // how many abstract forms the parser is within
 /* retrieves the next form from the lexer */
 FormType* next_form(LexerType* lexer)
 {
+    TokenBuffer* buffer=lexer->tokens;
+    // a new unit starts once the last ones tokens have all been parsed
+    if (buffer->cursor==buffer->count && form_depth==0){token_buffer_clear(buffer);lex_into(lexer,buffer);}
+    int first_token=buffer->cursor;
+    FormType* form=match_form(lexer);
+    form->first_token=first_token;
+    form->last_token=buffer->cursor-1;
+    return form;
+}
+/*
+    Abstract forms are memoized (packrat parsing) by the token they start
+    from so that going back to try something else never parses the same
+    abstract form twice. The memo is for the current unit only (the tokens
+    buffer) since that's what the positions are in. The depth they can be
+    nested is limited by MAX_FORM_DEPTH. Like the buffer, each thread
+    has its own.
+*/
+#define MAX_FORM_DEPTH 256
+
+__thread FormType** memo_forms; // the abstract form matched from each token
+__thread int* memo_ends; // the cursor after it
+__thread int* memo_units; // the buffers unit when it was matched
+__thread int memo_capacity=0;
+
+FormType* memo_form(LexerType* lexer)
+{
+    TokenBuffer* buffer=lexer->tokens;
+    int position=buffer->cursor;
+    if (position < memo_capacity && memo_units[position]==buffer->unit)
+    {
+        memo_hits++;
+        buffer->cursor=memo_ends[position];
+        return memo_forms[position];
+    }
+    memo_misses++;
+    if (form_depth==MAX_FORM_DEPTH)
+    {
+        // not memoized since it depends on where it's from
+        FormType* form=form_init();
+        ERROR("Abstract Form error: Max form depth reached\n")
+    }
+    form_depth++;
+    FormType* form=next_form(lexer);
+    form_depth--;
+    if (position >= memo_capacity)
+    {
+        int capacity=memo_capacity;
+        memo_capacity = buffer->capacity > position ? buffer->capacity : position+1;
+        memo_forms=realloc(memo_forms, memo_capacity*sizeof(FormType*));
+        memo_ends=realloc(memo_ends, memo_capacity*sizeof(int));
+        memo_units=realloc(memo_units, memo_capacity*sizeof(int));
+        for (int i = capacity; i < memo_capacity; i++){memo_units[i]=-1;}
+    }
+    memo_forms[position]=form;
+    memo_ends[position]=buffer->cursor;
+    memo_units[position]=buffer->unit;
+    return form;
+}
+/*
+    matches an abstract form from the cursor into the forms partial form at
+    form_index before carrying on from node, returning why it couldn't (or NULL)
+*/
+char* abstract_form(LexerType* lexer, FormType* form, int node, int form_index)
+{
+    // you shouldn't have an abstract form next to another abstract form
+    if (lexer->grammar->forms.abstract[node]){return "Abstract Form error: cannot have an abstract form next to another abstract form\n";}
+    FormType* abstract=memo_form(lexer);
+    if (abstract->type < 0){return abstract->message ? abstract->message : "Abstract Form error: Abstract form failed to match\n";}
+    form->partial_form[form_index]=NULL; // its place in the partial form is left empty
+    form->abstract_form=abstract;
+    return NULL;
+}
+/* somewhere a dead end can go back to */
+typedef struct FORM_FALLBACK_STRUCT
+{
+    int form; // the form that matched (-1 if it's an abstract form to match instead)
+    int node; // the node after the abstract form (0 if there's nowhere to go back to)
+    int form_index;
+    int cursor;
+    TokenType* partial_form[MAX_FORM_SIZE];
+    FormType* abstract_form;
+} FormFallback;
+
+#define FALLBACK(fallback,form_type,to) \
+fallback.form=form_type; \
+fallback.node=to; \
+fallback.form_index=form_index; \
+fallback.cursor=cursor; \
+memcpy(fallback.partial_form, form->partial_form, sizeof(form->partial_form)); \
+fallback.abstract_form=form->abstract_form;
+/*
+    matches the tokens from the lexer to a form
+
+    A dead end goes back to the last place an abstract form could've 
+    been matched rather than the token and once there aren't any left 
+    to try the longest form that matched is used
+*/
+FormType* match_form(LexerType* lexer)
+{
+    FormAutomatonType* automaton=&lexer->grammar->forms;
+    TokenBuffer* buffer=lexer->tokens;
     FormType* form=form_init();
-    int form_index=-1; // -1 for checking MAX_FORM_SIZE and using 0 based indexing
-    // cache the forms for efficiency
-    int prev_index=0;
-    int CACHED_FORMS[2]={-1,-1}; // list of current indexes
-    /* other variables used */
-    int matches,flag,i,token_ID;
-    TokenType* token;
-    while(1) // while it's not formed
-    {
-        /*
-            Forms an array of partial forms (tokens)
-        */
-        form_index++;
-        token=next_token(lexer);
-        // check if the formation is not valid and if the lexer has finished or encountered an error before formation
-        if (form_index==MAX_FORM_SIZE){ERROR("Max form size reached\n")}
+    FormFallback fallbacks[MAX_FORM_SIZE+1];
+    FormFallback matched={-1,0};
+    int fallback_count=0, node=0, form_index=0;
+    while (1)
+    {
+        char* dead_end=NULL; // why the token can't carry on the form
+        int cursor=buffer->cursor;
+        TokenType* token=parser_next(lexer);
         if (token->type==TOKEN_ERROR){ERROR("Syntax error\n")}
-        form->partial_form[form_index]=token;
-        if (token->type==TOKEN_EOF || token->type==TOKEN_NEWLINE)
+        int next=automaton->next[node*automaton->class_count+FORM_CLASS(token->type)];
+        int ended=token->type==TOKEN_EOF || token->type==TOKEN_NEWLINE || token->type==TOKEN_LINE_CONTINUATION;
+        if (form_index==0 && ended)
         {
-            if (form_index > 0){form->type=SYNTAX_ERROR;return form;}
-            form->type=TOKEN_NEWLINE;return form;
+            form->partial_form[0]=token;
+            form->type = token->type==TOKEN_LINE_CONTINUATION ? TOKEN_LINE_CONTINUATION : TOKEN_NEWLINE;
+            return form;
         }
-        if (token->type==TOKEN_LINE_CONTINUATION){form->type=TOKEN_LINE_CONTINUATION;return form;}
-        /*
-            Finds the unique form based on matching tokens sequentially
-            in reference to the FORMS array
-
-            1. go through the CACHED_FORMS (delete any that don't match) (increase matches if match)
-            2. go through the remaining FORMS (add any to the cache that match) ...
-            break whenever there's more than one match
-        */
-        /* CACHED_FORMS */
-        // break or remove
-        token_ID=token->type;
-        matches=0;
-        i=0;
-        while (i < 2 && CACHED_FORMS[i] != -1)
+        // check if the formation is not valid before formation
+        if (form_index==MAX_FORM_SIZE){dead_end="Max form size reached\n";}
+        else if (next)
         {
-            if (isform(token_ID,FORMS[CACHED_FORMS[i]][form_index])){matches++;i++;continue;}
-            // remove the index
-            if (i==0){CACHED_FORMS[0]=CACHED_FORMS[1];CACHED_FORMS[1]=-1;}
-            else{CACHED_FORMS[1]=-1;break;}
+            if (automaton->abstract[node]){FALLBACK(fallbacks[fallback_count],-1,automaton->abstract[node])fallback_count++;}
+            form->partial_form[form_index++]=token;
+            node=next;
         }
-        /* FORMS */
-        if (matches < 2)
+        else if (automaton->abstract[node] && !ended)
         {
-            i = prev_index;
-            int* reference_token=FORMS[i];
-            while (reference_token[0]!=0)
+            // the abstract form starts from the token
+            buffer->cursor=cursor;
+            dead_end=abstract_form(lexer,form,automaton->abstract[node],form_index);
+            if (!dead_end){node=automaton->abstract[node];form_index++;}
+        }
+        else{dead_end="Form Error: No matches found\n";}
+        /* go back to the last fallback (an error carries on from the furthest token tried) */
+        int furthest=buffer->cursor;
+        while (dead_end)
+        {
+            if (buffer->cursor > furthest){furthest=buffer->cursor;}
+            FormFallback* fallback = fallback_count ? &fallbacks[--fallback_count] : &matched;
+            if (fallback->node==0)
             {
-                for (int j = 0; j <= form_index; j++) /* <= since index is the actual index */
-                {
-                    token_ID=form->partial_form[form_index-j]->type;
-                    flag=isform(token_ID,reference_token[form_index-j]);
-                    /* abstract forms defer to the next token */
-                    if (flag==-1)
-                    {   /* if it's a matching form then nothing happens, if not, then it's an abstract form */
-                        flag=isform(token_ID,reference_token[form_index+1]);
-                        /*
-                            matches used here is 1 less than what's in the switch 
-                            statement since the INDICATOR macro increases it by 1
-                        */
-                        // you shouldn't have an abstract form next to another abstract form
-                        if (flag==-1){matches=3;BREAK(1)}
-                        // if it does or doesn't match it still could since it's an abstract form
-                        if (!flag){matches=2;BREAK(1)}
-                        else{BREAK(1)}
-                    }
-                    if (!flag){BREAK(-1)}
-                }
-                if (flag!=-1)
-                {
-                    // add the index
-                    if (CACHED_FORMS[0]==-1){CACHED_FORMS[0]=i;}
-                    else {CACHED_FORMS[1]=i;}
-                    INDICATOR
-                }
-                i++;
-                prev_index=i;
-                reference_token=FORMS[i];
+                buffer->cursor=furthest;
+                if (token->type==TOKEN_LINE_CONTINUATION){form->type=TOKEN_LINE_CONTINUATION;return form;}
+                if (token->type==TOKEN_EOF || token->type==TOKEN_NEWLINE){form->type=SYNTAX_ERROR;return form;}
+                ERROR(dead_end)
             }
+            buffer->cursor=fallback->cursor;
+            form_index=fallback->form_index;
+            memcpy(form->partial_form, fallback->partial_form, sizeof(form->partial_form));
+            form->abstract_form=fallback->abstract_form;
+            if (fallback->form!=-1){form->type=fallback->form;return form;}
+            node=fallback->node;
+            dead_end=abstract_form(lexer,form,node,form_index);
+            if (!dead_end){form_index++;}
         }
-        /************************************************
-        *  Assign the form based on the matches found   *
-        ************************************************/
-        switch (matches)
+        if (automaton->match[node]!=-1)
         {
-            case 0: // no matches found
-                ERROR("Form Error: No matches found\n")
-            case 1: // match found
-                flag=CACHED_FORMS[0];
-                // it has to match exactly
-                if (form_index+1!=int_len(FORMS[flag])){break;}
-                form->type=flag;
-                return form;
-            case 2: // further matches are possible
-                break;
-            case 3: // it's an abstract form, but once done it should be of the indexes form
-                // form->type=CACHED_FORMS[0];
-                form->abstract_form=next_form(lexer);
-                int* temp=FORMS[CACHED_FORMS[0]];
-                if (form->abstract_form->type!=temp[form_index+1]){ERROR("Abstract Form error: Abstract form failed to match\n")}
-                // go through the remaining tokens to get the full match (if not already)
-                form_index++;
-                if (form_index+1==int_len(temp)){return form;}
-                break;
-            case 4: /* SYNTAX_ERROR from having an abstract form next to another abstract form */
-                ERROR("Abstract Form error: cannot have an abstract form next to another abstract form\n")
+            if (automaton->last[node]){form->type=automaton->match[node];return form;}
+            cursor=buffer->cursor;
+            if (cursor >= matched.cursor || matched.node==0){FALLBACK(matched,automaton->match[node],node)}
         }
     }
 }
+/* 
+    writes the form into the stream in postfix order 
+    (its abstract form goes before it)
+*/
+void form_flatten(FormType* form, FormStream* stream)
+{
+    if (form->abstract_form){form_flatten(form->abstract_form,stream);}
+    if (stream->count==stream->capacity)
+    {
+        stream->capacity = stream->capacity ? stream->capacity*2 : 64;
+        stream->records = realloc(stream->records, stream->capacity*sizeof(FormRecord));
+    }
+    FormRecord* record=&stream->records[stream->count++];
+    record->type=form->type;
+    record->first_token=form->first_token;
+    record->tokens=form->last_token-form->first_token+1;
+    record->children=form->abstract_form!=NULL;
+}
+/* 
+    parses the next statement into the stream as a postfix array of form 
+    records (returning the form it was matched as i.e. for its message)
+*/
+FormType* next_statement(LexerType* lexer, FormStream* stream)
+{
+    unsigned long long began = profiling ? profile_clock() : 0, lexed=lex_cycles;
+    FormType* form=next_form(lexer);
+    stream->count=0;
+    stream->grammar=lexer->grammar;
+    form_flatten(form,stream);
+    if (began){profile_add(&profile_phases[PHASE_PARSE],profile_clock()-began-(lex_cycles-lexed));}
+    return form;
+}
 /*****************************
 *    Main evaluation loop    *
 *****************************/
@@ -175,14 +261,568 @@ FormType* next_form(LexerType* lexer)
     Anything else is extra to help the program
     run better for the intended use cases.
 */
-void eval_loop(char input[],int INPUT_LIMIT)
+/* evaluates every statement left in the lexer */
+void eval_lexer(LexerType* lexer)
+{
+    while (parser_isrunning(lexer))
+    {
+        next_statement(lexer,&unit_forms);
+        code_clear(&unit_code);
+        eval(&unit_code,compile_statement(&unit_forms,lexer->tokens,&unit_code));
+        // the lines tokens and forms are no longer needed once it's all been parsed
+        if (lexer->tokens->cursor==lexer->tokens->count){arena_reset(&unit_arena);}
+    }
+}
+void eval_loop(FILE* input)
 {
     globals=table_init();
-    LexerType* lexer;
-    while (fgets(input, INPUT_LIMIT, stdin))
-    {  
-        lexer = lexer_init(input);
-        while (lexer_isrunning(lexer)){eval(next_form(lexer));}
-        printf(">>> ");
-    }
-}
\ No newline at end of file
+    LexerType* lexer=lexer_init_stream(input); // lines aren't limited in length since the stream is refilled as needed
+    lexer->prompt=">>> ";
+    eval_lexer(lexer);
+    lexer_free(lexer);
+}
+/* 
+    evaluates a whole file (it's memory mapped or streamed 
+    so it's lexed in constant memory regardless of its size)
+*/
+void eval_file(char* path)
+{
+    if (globals==NULL){globals=table_init();}
+    LexerType* lexer=lexer_init_file(path);
+    if (lexer==NULL){printf("Error: Could not open the file '%s'\n",path);return;}
+    eval_lexer(lexer);
+    lexer_free(lexer);
+}
+/*****************************
+*        Script mode         *
+*****************************/
+/*
+    eval_script is eval_file with the lexing and parsing done on threads.
+
+    The (mapped) file is split into chunks at the ends of lines (not ones 
+    carried on by a line continuation) and the threads each parse a chunk 
+    into bytecode while the calling thread evaluates them in order.
+
+    A chunk is parsed past its end until a statement finishes at the end 
+    of a line, and the next chunk is only used if it starts where that one 
+    stopped (i.e. it wasn't started inside a string or a multiline comment), 
+    otherwise it's parsed again from there first.
+
+    A chunks compile errors are kept with it (and thrown away if it's 
+    parsed again) and printed before the statement they're from is 
+    evaluated, so they come out in order with the scripts output.
+
+    Internal commands can change the grammar and forms so the ones the 
+    script starts with (i.e. the forms it adds) are evaluated first and the 
+    rest is parsed with the grammar they leave, and everything from the 
+    line with the next one on is done serially (as does a file that 
+    couldn't be mapped).
+*/
+#define SCRIPT_CHUNK_SIZE 65536
+#define SCRIPT_CHUNKS_PER_THREAD 8
+
+typedef struct SCRIPT_CHUNK_STRUCT
+{
+    int start;
+    int end; // it stops at the first statement to finish from here on
+    int stop; // where it did stop
+    FormStream stream; // the statement being compiled
+    CodeType code;
+    int* statements; // where each statement starts in the code
+    int statement_count;
+    int statement_capacity;
+    Diagnostics errors; // its compile errors
+    int* error_ends; // where each statements errors end in errors
+    int memo_hits;
+    int memo_misses;
+    int parsed;
+} ScriptChunk;
+
+typedef struct SCRIPT_STRUCT
+{
+    char* source;
+    int length;
+    GrammarSnapshot* grammar; // every chunk's parsed with the same one
+    ScriptChunk* chunks;
+    int chunk_count;
+    int next; // the next chunk for a thread to take
+    pthread_mutex_t lock;
+    pthread_cond_t parsed;
+} ScriptType;
+
+/* parses the statements of the chunk from its start */
+void parse_chunk(ScriptType* script, ScriptChunk* chunk)
+{
+    LexerType* lexer=lexer_init_span(script->source,script->length,chunk->start,script->grammar);
+    int hits=memo_hits, misses=memo_misses;
+    chunk->stream.grammar=script->grammar;
+    chunk->statement_count=0;
+    chunk->errors.length=0;
+    code_clear(&chunk->code);
+    compile_diagnostics=&chunk->errors;
+    while (parser_isrunning(lexer))
+    {
+        next_statement(lexer,&chunk->stream);
+        if (chunk->statement_count==chunk->statement_capacity)
+        {
+            chunk->statement_capacity = chunk->statement_capacity ? chunk->statement_capacity*2 : 64;
+            chunk->statements=realloc(chunk->statements, chunk->statement_capacity*sizeof(int));
+            chunk->error_ends=realloc(chunk->error_ends, chunk->statement_capacity*sizeof(int));
+        }
+        chunk->statements[chunk->statement_count]=compile_statement(&chunk->stream,lexer->tokens,&chunk->code);
+        chunk->error_ends[chunk->statement_count++]=chunk->errors.length;
+        if (lexer->tokens->cursor==lexer->tokens->count)
+        {
+            arena_reset(&unit_arena);
+            if (lexer->index >= chunk->end && lexer->source[lexer->index-1]=='\n'){break;}
+        }
+    }
+    compile_diagnostics=NULL;
+    chunk->stop=lexer->index;
+    // they're added on when the chunk is evaluated
+    chunk->memo_hits=memo_hits-hits;
+    chunk->memo_misses=memo_misses-misses;
+    memo_hits=hits;
+    memo_misses=misses;
+    lexer_free(lexer);
+}
+/* evaluates the chunks statements in order (each ones compile errors are printed before it) */
+void eval_chunk(ScriptChunk* chunk)
+{
+    for (int j = 0, printed = 0; j < chunk->statement_count; j++)
+    {
+        if (chunk->error_ends[j] > printed)
+        {
+            fwrite(chunk->errors.text+printed, 1, chunk->error_ends[j]-printed, stdout);
+            printed=chunk->error_ends[j];
+        }
+        eval(&chunk->code,chunk->statements[j]);
+        arena_reset(&unit_arena);
+    }
+}
+void chunk_free(ScriptChunk* chunk)
+{
+    free(chunk->stream.records);
+    code_free(&chunk->code);
+    free(chunk->statements);
+    free(chunk->error_ends);
+    free(chunk->errors.text);
+}
+/* what each thread does (takes chunks until there aren't any left) */
+void* script_worker(void* data)
+{
+    ScriptType* script=data;
+    while (1)
+    {
+        pthread_mutex_lock(&script->lock);
+        int next=script->next++;
+        pthread_mutex_unlock(&script->lock);
+        if (next >= script->chunk_count){break;}
+        parse_chunk(script,&script->chunks[next]);
+        pthread_mutex_lock(&script->lock);
+        script->chunks[next].parsed=1;
+        pthread_cond_broadcast(&script->parsed);
+        pthread_mutex_unlock(&script->lock);
+    }
+    // the threads own these
+    arena_free(&unit_arena);
+    free(unit_tokens.types);free(unit_tokens.offsets);free(unit_tokens.lengths);free(unit_tokens.symbols);free(unit_tokens.tokens);
+    free(memo_forms);free(memo_ends);free(memo_units);
+    return NULL;
+}
+/* returns where the line after index starts (the length if there isn't one) */
+int script_line_end(char* source, int length, int index)
+{
+    while (index < length)
+    {
+        char* newline=memchr(source+index,'\n',length-index);
+        if (newline==NULL){return length;}
+        index=newline-source+1;
+        // a line continuation carries the statement onto the next line
+        int last=index-2;
+        if (last >= 0 && source[last]=='\r'){last--;}
+        if (last < 0 || source[last]!='\\'){return index;}
+    }
+    return length;
+}
+/* returns where the lines the script starts with that are internal commands (or blank) end */
+int script_prelude_end(char* source, int length)
+{
+    char* internal=start_grammar[INTERNAL];
+    int internal_length=strlen(internal);
+    if (internal_length==0){return 0;}
+    int index=0;
+    while (index < length)
+    {
+        int start=index;
+        while (index < length && (source[index]==' ' || source[index]=='\t' || source[index]=='\r')){index++;}
+        if (index < length && source[index]!='\n' && (length-index < internal_length || memcmp(source+index,internal,internal_length)!=0)){return start;}
+        index=script_line_end(source,length,index);
+    }
+    return length;
+}
+/* 
+    evaluates the internal commands the script starts with and moves the 
+    lexer onto the grammar they leave, returning where the rest starts
+*/
+int eval_prelude(LexerType* lexer)
+{
+    int end=script_prelude_end(lexer->source,lexer->length);
+    if (end==0){return 0;}
+    LexerType* prelude=lexer_init_span(lexer->source,end,0,lexer->grammar);
+    eval_lexer(prelude);
+    lexer_free(prelude);
+    token_buffer_clear(lexer->tokens);
+    lexer_refresh(lexer);
+    lexer_seek(lexer,end);
+    return end;
+}
+/* returns where the line with the first internal command from index on starts (the length if there isn't one) */
+int script_serial_start(char* source, int length, int index)
+{
+    char* internal=start_grammar[INTERNAL];
+    int internal_length=strlen(internal);
+    if (internal_length==0){return length;}
+    for (; index + internal_length <= length; index++)
+    {
+        char* found=memchr(source+index,internal[0],length-index-internal_length+1);
+        if (found==NULL){break;}
+        index=found-source;
+        if (memcmp(found,internal,internal_length)==0)
+        {
+            while (index > 0 && source[index-1]!='\n'){index--;}
+            return index;
+        }
+    }
+    return length;
+}
+void eval_script(char* path, int threads)
+{
+    if (globals==NULL){globals=table_init();}
+    LexerType* lexer=lexer_init_file(path);
+    if (lexer==NULL){printf("Error: Could not open the file '%s'\n",path);return;}
+    if (!lexer->mapped || threads < 1){eval_lexer(lexer);lexer_free(lexer);return;}
+    int prelude=eval_prelude(lexer);
+    ScriptType script={lexer->source,lexer->length,lexer->grammar};
+    int serial=script_serial_start(script.source,script.length,prelude);
+    int size=(serial-prelude)/(threads*SCRIPT_CHUNKS_PER_THREAD);
+    if (size < SCRIPT_CHUNK_SIZE){size=SCRIPT_CHUNK_SIZE;}
+    script.chunks=calloc((serial-prelude)/size+1,sizeof(ScriptChunk));
+    for (int start = prelude; start < serial; start = script.chunks[script.chunk_count++].end)
+    {
+        ScriptChunk* chunk=&script.chunks[script.chunk_count];
+        chunk->start=start;
+        chunk->end = serial-start > size ? script_line_end(script.source,serial,start+size) : serial;
+    }
+    pthread_mutex_init(&script.lock,NULL);
+    pthread_cond_init(&script.parsed,NULL);
+    pthread_t* workers=malloc(threads*sizeof(pthread_t));
+    symbol_threads=1;
+    for (int i = 0; i < threads; i++){pthread_create(&workers[i],NULL,script_worker,&script);}
+    int position=prelude; // where the last chunk stopped
+    for (int i = 0; i < script.chunk_count; i++)
+    {
+        ScriptChunk* chunk=&script.chunks[i];
+        pthread_mutex_lock(&script.lock);
+        while (!chunk->parsed){pthread_cond_wait(&script.parsed,&script.lock);}
+        pthread_mutex_unlock(&script.lock);
+        // the last chunk could've stopped anywhere in this one (or past it)
+        if (position < chunk->end)
+        {
+            if (chunk->start!=position){chunk->start=position;parse_chunk(&script,chunk);}
+            memo_hits+=chunk->memo_hits;
+            memo_misses+=chunk->memo_misses;
+            eval_chunk(chunk);
+            position=chunk->stop;
+        }
+        chunk_free(chunk);
+    }
+    for (int i = 0; i < threads; i++){pthread_join(workers[i],NULL);}
+    symbol_threads=0;
+    free(workers);
+    free(script.chunks);
+    pthread_mutex_destroy(&script.lock);
+    pthread_cond_destroy(&script.parsed);
+    // the rest is done serially
+    token_buffer_clear(lexer->tokens);
+    lexer_seek(lexer,position);
+    eval_lexer(lexer);
+    lexer_free(lexer);
+}
+/*****************************
+*     Ahead of time mode     *
+*****************************/
+/*
+    eval_aot is eval_file but the script is transpiled into C (a call to 
+    the same helpers the JIT uses for each instruction) that's compiled 
+    into a shared object with the system compiler and cached in AOT_CACHE 
+    (under $XDG_CACHE_HOME or ~/.cache) by a hash of the source and grammar, 
+    so later runs dlopen it and run it without lexing or parsing anything.
+
+    Only a cache directory and shared objects that are the users own and 
+    that nobody else can write to are used (otherwise anyone could have 
+    put the shared object there). A script that fails to compile (or has 
+    compile errors) leaves a .failed marker so it's only evaluated from 
+    then on (delete it to try again). On Windows there's no dlopen so it's just eval_file.
+
+    Symbols are interned by name and the constants are made into values 
+    when it's loaded since their ids (and strings addresses) can be 
+    different from run to run. The instructions are put together into 
+    code from the runtime then too so LOAD and STORE have inline caches.
+
+    The internal commands a script starts with (i.e. the forms it adds) 
+    are evaluated first and the rest is keyed and compiled with the grammar 
+    they leave. Scripts with internal commands after that aren't compiled 
+    (they can change the grammar part way through) and are evaluated as 
+    usual instead.
+*/
+#define AOT_CACHE "virtual-machine"
+#define AOT_COMPILER "cc", "-O1", "-shared", "-fPIC", "-w" // the compilers argv (the paths go after it)
+#define AOT_FORMAT 3 // changes whenever what's written out does
+
+typedef struct AOT_RUNTIME_STRUCT
+{
+    int (*intern)(char* name, int length);
+    Value (*constant)(char* text, int type);
+    CodeType* (*code)(int length);
+    int (*helpers[BASE_OPCODES])(JitFrame* frame, int* ip);
+    void (*end)(void);
+} AotRuntime;
+
+Value aot_constant(char* text, int type){return constant_value(text,type,OWNER_CODE);}
+CodeType aot_unit; // the scripts instructions (filled in by aot_main)
+CodeType* aot_code(int length)
+{
+    for (int i = 0; i < length; i++){emit(&aot_unit,OP_END,0);}
+    return &aot_unit;
+}
+void aot_end(){gc_safepoint();arena_reset(&unit_arena);}
+
+/* the source, the grammar and the forms all change what a script compiles into */
+unsigned long long aot_key(char* source, int length)
+{
+    unsigned long long hash=hash_bytes(grammar_hash(), source, length);
+    hash=hash_bytes(hash, FORMS, sizeof(FORMS));
+    hash=hash_bytes(hash, EXEC_FORMS, sizeof(EXEC_FORMS));
+    int layout[]={AOT_FORMAT,BASE_OPCODES,sizeof(JitFrame),EVAL_STACK_SIZE,len(operators),len(external_names)};
+    return hash_bytes(hash, layout, sizeof(layout));
+}
+void aot_string(FILE* file, char* value)
+{
+    fputc('"', file);
+    for (; *value; value++)
+    {
+        unsigned char c=*value;
+        if (c=='"' || c=='\\'){fprintf(file, "\\%c", c);}
+        else if (c < 32 || c > 126){fprintf(file, "\\%03o", c);}
+        else{fputc(c, file);}
+    }
+    fputc('"', file);
+}
+/* 
+    writes the statements as C, there's a function for each sequence of 
+    opcodes (given where its operands are) and the statements are data
+*/
+void aot_emit(FILE* file, CodeType* code, int* statements, int count)
+{
+    // the symbols used are numbered in the order they're first seen
+    int* numbers=calloc(symbols_length+1, sizeof(int));
+    int* names=malloc((symbols_length+1)*sizeof(int));
+    int name_count=0;
+    // statements with the same opcodes have the same shape (it's the first one's start)
+    int size=1;
+    while (size < count*2){size*=2;}
+    int* table=malloc(size*sizeof(int));
+    memset(table, -1, size*sizeof(int));
+    int* shapes=malloc((count+1)*sizeof(int)); // each shapes statement
+    int* shape_of=malloc((count+1)*sizeof(int));
+    int shape_count=0;
+    fprintf(file, "/* written by eval_aot */\n");
+    fprintf(file, "typedef unsigned long long Value;\n");
+    fprintf(file, "typedef struct {void* code; Value* stack; int top;} JitFrame;\n");
+    fprintf(file, "typedef struct {int* code;} CodeType;\n");
+    fprintf(file, "typedef struct {int (*intern)(char*, int); Value (*constant)(char*, int); CodeType* (*code)(int); int (*helpers[%d])(JitFrame*, int*); void (*end)(void);} AotRuntime;\n", BASE_OPCODES);
+    fprintf(file, "static char* k[]={");
+    for (int i = 0; i < code->constant_count; i++){aot_string(file, code->pool+code->constants[i]);fputc(',', file);}
+    fprintf(file, "0};\nstatic const int kt[]={");
+    for (int i = 0; i < code->constant_count; i++){fprintf(file, "%d,", code->types[i]);}
+    fprintf(file, "0};\nstatic Value kv[%d];\nstatic const int o[]={", code->constant_count+1);
+    for (int i = 0; i < count; i++)
+    {
+        unsigned int hash=2166136261u;
+        int* ip=code->code+statements[i];
+        for (; OPCODE(*ip)!=OP_END; ip++)
+        {
+            int opcode=base_opcode(OPCODE(*ip)), operand=OPERAND(*ip);
+            hash=(hash^opcode)*16777619u;
+            if ((opcode==OP_LOAD || opcode==OP_STORE || opcode==OP_DELETE) && numbers[operand]==0)
+            {
+                names[name_count++]=operand;
+                numbers[operand]=name_count;
+            }
+            // the names number in place of the symbol (s has its symbol once it's loaded)
+            fprintf(file, "%d,", INSTRUCTION(opcode,opcode==OP_LOAD || opcode==OP_STORE || opcode==OP_DELETE ? numbers[operand]-1 : operand));
+        }
+        for (unsigned int j = hash;; j++)
+        {
+            int* slot=&table[j&(size-1)];
+            if (*slot==-1){*slot=shape_count;shapes[shape_count++]=statements[i];}
+            int* a=code->code+shapes[*slot], *b=code->code+statements[i];
+            while (OPCODE(*a)!=OP_END && base_opcode(OPCODE(*a))==base_opcode(OPCODE(*b))){a++;b++;}
+            if (OPCODE(*a)==OP_END && OPCODE(*b)==OP_END){shape_of[i]=*slot;break;}
+        }
+        if (i%16==15){fputc('\n', file);}
+    }
+    fprintf(file, "0};\nstatic const int shape_of[]={");
+    for (int i = 0; i < count; i++){fprintf(file, "%d,%s", shape_of[i], i%32==31 ? "\n" : "");}
+    fprintf(file, "0};\nstatic int s[%d];\nstatic char* names[]={", name_count+1);
+    for (int i = 0; i < name_count; i++){aot_string(file, symbol_name(names[i]));fputc(',', file);}
+    fprintf(file, "0};\n");
+    for (int i = 0; i < shape_count; i++)
+    {
+        fprintf(file, "static void shape%d(AotRuntime* vm, JitFrame* f, int* ip)\n{\n", i);
+        int j=0;
+        for (int* ip = code->code+shapes[i]; OPCODE(*ip)!=OP_END; ip++, j++)
+        {
+            int opcode=base_opcode(OPCODE(*ip));
+            if (opcode==OP_CONST){fprintf(file, "    f->stack[f->top++]=kv[ip[%d]>>8];\n", j);}
+            else{fprintf(file, "    if (vm->helpers[%d](f, ip+%d)){return;}\n", opcode, j);}
+        }
+        fprintf(file, "}\n");
+    }
+    fprintf(file, "static void (*shapes[])(AotRuntime*, JitFrame*, int*)={");
+    for (int i = 0; i < shape_count; i++){fprintf(file, "shape%d,", i);}
+    fprintf(file, "0};\nstatic const int lengths[]={");
+    for (int i = 0; i < shape_count; i++)
+    {
+        int length=0;
+        while (OPCODE(code->code[shapes[i]+length])!=OP_END){length++;}
+        fprintf(file, "%d,", length);
+    }
+    fprintf(file, "0};\n");
+    fprintf(file, "int aot_main(AotRuntime* vm)\n{\n    Value stack[%d];\n    JitFrame f={0,stack,0};\n", EVAL_STACK_SIZE);
+    fprintf(file, "    for (int i = 0; names[i]; i++){int length=0;while (names[i][length]){length++;}s[i]=vm->intern(names[i],length);}\n");
+    fprintf(file, "    for (int i = 0; k[i]; i++){kv[i]=vm->constant(k[i],kt[i]);}\n");
+    fprintf(file, "    int length=sizeof(o)/sizeof(int)-1;\n    CodeType* code=vm->code(length);\n    f.code=code;\n");
+    fprintf(file, "    for (int i = 0; i < length; i++)\n    {\n");
+    fprintf(file, "        int opcode=o[i]&255, operand=o[i]>>8;\n");
+    fprintf(file, "        code->code[i]=(opcode==%d || opcode==%d || opcode==%d ? s[operand] : operand)<<8|opcode;\n    }\n", OP_LOAD, OP_STORE, OP_DELETE);
+    fprintf(file, "    int* ip=code->code;\n");
+    fprintf(file, "    for (int i = 0; i < %d; i++)\n    {\n", count);
+    fprintf(file, "        f.top=0;\n        shapes[shape_of[i]](vm,&f,ip);\n        ip+=lengths[shape_of[i]];\n        vm->end();\n    }\n");
+    fprintf(file, "    return 0;\n}\n");
+    free(numbers);
+    free(names);
+    free(table);
+    free(shapes);
+    free(shape_of);
+}
+#ifndef _WIN32
+/* 1 if the path is a kind (S_IFDIR or S_IFREG) the user owns and only they can write to */
+int aot_trusted(char* path, int kind)
+{
+    struct stat info;
+    return lstat(path, &info)==0 && (info.st_mode & S_IFMT)==kind && info.st_uid==getuid() && (info.st_mode & 022)==0;
+}
+/* the cache directory (made if it isn't there) returning 0 if it can't be used */
+int aot_cache_directory(char* path, int size)
+{
+    char* cache=getenv("XDG_CACHE_HOME"), *home=getenv("HOME"), parent[256];
+    if (cache && cache[0]=='/'){snprintf(parent, sizeof(parent), "%s", cache);}
+    else if (home && home[0]){snprintf(parent, sizeof(parent), "%s/.cache", home);}
+    else{return 0;}
+    mkdir(parent, 0700);
+    if (snprintf(path, size, "%s/" AOT_CACHE, parent) >= size){return 0;}
+    mkdir(path, 0700);
+    return aot_trusted(path, S_IFDIR);
+}
+extern char** environ;
+/* 
+    runs the compiler on source (without a shell so nothing in the paths 
+    is interpreted) returning 0 if it couldn't be run or failed
+*/
+int aot_build(char* source, char* object)
+{
+    char* argv[]={AOT_COMPILER, "-o", object, source, NULL};
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ)!=0){return 0;}
+    return waitpid(pid, &status, 0)==pid && WIFEXITED(status) && WEXITSTATUS(status)==0;
+}
+/* 
+    compiles the script into the shared object (returning 0 if it couldn't), 
+    a script with compile errors isn't since they'd never be printed again
+*/
+int aot_compile(ScriptType* script, int start, char* path)
+{
+    ScriptChunk chunk={start,script->length};
+    parse_chunk(script,&chunk);
+    char source[300], temp[300]; // room for what's added onto the path
+    snprintf(source, sizeof(source), "%s.c", path);
+    snprintf(temp, sizeof(temp), "%s.%d", path, getpid());
+    FILE* file = chunk.errors.length ? NULL : fopen(source, "w");
+    int compiled=0;
+    if (file)
+    {
+        aot_emit(file, &chunk.code, chunk.statements, chunk.statement_count);
+        fclose(file);
+        // it's renamed once it's done so another run never loads half of one
+        compiled=aot_build(source, temp) && rename(temp, path)==0;
+        remove(source);
+        if (!compiled){remove(temp);}
+    }
+    if (!compiled)
+    {
+        snprintf(temp, sizeof(temp), "%s.failed", path);
+        FILE* marker=fopen(temp, "w");
+        if (marker){fclose(marker);}
+        // the script's already been parsed so it's evaluated from that
+        eval_chunk(&chunk);
+    }
+    chunk_free(&chunk);
+    return compiled;
+}
+void eval_aot(char* path)
+{
+    if (globals==NULL){globals=table_init();}
+    LexerType* lexer=lexer_init_file(path);
+    if (lexer==NULL){printf("Error: Could not open the file '%s'\n",path);return;}
+    if (!lexer->mapped){eval_lexer(lexer);lexer_free(lexer);return;}
+    int prelude=eval_prelude(lexer);
+    ScriptType script={lexer->source,lexer->length,lexer->grammar};
+    if (script_serial_start(script.source,script.length,prelude) < script.length){eval_lexer(lexer);lexer_free(lexer);return;}
+    char directory[200], object[256], failed[300];
+    if (!aot_cache_directory(directory, sizeof(directory)))
+    {
+        printf("Error: There's no cache directory that only you can write to so '%s' isn't compiled\n",path);
+        eval_lexer(lexer);lexer_free(lexer);return;
+    }
+    snprintf(object, sizeof(object), "%s/%016llx.so", directory, aot_key(script.source+prelude,script.length-prelude));
+    snprintf(failed, sizeof(failed), "%s.failed", object);
+    if (access(failed, F_OK)==0){eval_lexer(lexer);lexer_free(lexer);return;} // it didn't compile last time
+    if (access(object, F_OK)!=0 && !aot_compile(&script,prelude,object)){lexer_free(lexer);return;}
+    if (!aot_trusted(object, S_IFREG))
+    {
+        printf("Error: '%s' isn't only yours to write to so it isn't loaded\n",object);
+        eval_lexer(lexer);lexer_free(lexer);return;
+    }
+    void* library=dlopen(object, RTLD_NOW|RTLD_LOCAL);
+    int (*aot_main)(AotRuntime*) = library ? dlsym(library, "aot_main") : NULL;
+    if (aot_main==NULL)
+    {
+        printf("Error: Could not load '%s' (%s)\n",object,dlerror());
+        if (library){dlclose(library);}
+        remove(object); // so it's compiled again next time
+        eval_lexer(lexer);lexer_free(lexer);return;
+    }
+    lexer_free(lexer);
+    AotRuntime runtime={symbol_intern,aot_constant,aot_code};
+    memcpy(runtime.helpers, jit_helpers, sizeof(runtime.helpers));
+    runtime.end=aot_end;
+    aot_main(&runtime);
+    code_free(&aot_unit);
+    dlclose(library);
+}
+#else
+void eval_aot(char* path){eval_file(path);}
+#endif
@@ -5,20 +5,371 @@
 #include <string.h> // strlen
 #include <ctype.h> // isdigit, isalnum
 #include <stdio.h> // printf, NULL
+#include <stdarg.h> // va_list
+#include <math.h> // fmod
+#include <limits.h> // INT_MAX
+#include <stdint.h> // uint64_t
+#include <stddef.h> // offsetof
+#include <pthread.h> // pthread_create, pthread_mutex_lock (winpthreads on MinGW)
+#include <stdatomic.h> // atomic_load, atomic_fetch_add
+#ifndef _WIN32
+#include <fcntl.h> // open
+#include <unistd.h> // read, close, isatty
+#include <sys/stat.h> // fstat, lstat
+#include <sys/mman.h> // mmap
+#include <dlfcn.h> // dlopen
+#include <spawn.h> // posix_spawnp
+#include <sys/wait.h> // waitpid
+#else
+#include <io.h> // _isatty, _fileno
+#endif
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h> // _mm_cmpeq_epi8, _mm256_cmpeq_epi8
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#endif
+#include <time.h> // clock_gettime
 #include "grammar.c"
 
+/***************************
+*     Arena allocator      *
+***************************/
+/*
+    The lexer and parser objects (tokens, forms, lexers) for one 
+    input unit (i.e. a line in eval_loop) are bump allocated from 
+    the unit_arena and are all released at once by arena_reset at 
+    the end of the unit, so nothing needs freeing individually.
+
+    Anything that has to outlive the unit (i.e. keys and values 
+    stored into globals) must be copied out of the arena with 
+    promote or promote_string.
+*/
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct ARENA_BLOCK_STRUCT
+{
+    struct ARENA_BLOCK_STRUCT* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct ARENA_STRUCT
+{
+    ArenaBlock* first;
+    ArenaBlock* current;
+    ArenaBlock* last;
+} ArenaType;
+
+__thread ArenaType unit_arena; // owns everything made while lexing and parsing the current input unit (each thread has its own)
+
+/* returns zeroed memory (like calloc) from the arena */
+void* arena_alloc(ArenaType* arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15; // keeps every allocation aligned
+    ArenaBlock* block = arena->current;
+    // the blocks kept from the last reset get reused before any new ones are made
+    while (block != NULL && block->used + size > block->size){block = block->next;}
+    if (block == NULL)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (arena->last){arena->last->next = block;}
+        else{arena->first = block;}
+        arena->last = block;
+    }
+    arena->current = block;
+    void* memory = block->data + block->used;
+    block->used += size;
+    memset(memory, 0, size);
+    return memory;
+}
+/* 
+    releases everything allocated in the arena at once (the blocks
+    are kept for the next unit so memory usage stays flat)
+*/
+void arena_reset(ArenaType* arena)
+{
+    for (ArenaBlock* block = arena->first; block != NULL; block = block->next){block->used = 0;}
+    arena->current = arena->first;
+}
+/* gives the arenas blocks back (i.e. when the thread it's for is finished) */
+void arena_free(ArenaType* arena)
+{
+    while (arena->first != NULL)
+    {
+        ArenaBlock* next = arena->first->next;
+        free(arena->first);
+        arena->first = next;
+    }
+    arena->current = arena->last = NULL;
+}
+/* copies a value out of the arena onto the heap so it can outlive the input unit */
+void* promote(void* value, size_t size)
+{
+    void* copy = malloc(size);
+    memcpy(copy, value, size);
+    return copy;
+}
+char* promote_string(char* value){return promote(value, (strlen(value) + 1) * sizeof(char));}
+
+/***************************
+*      Slab allocator      *
+***************************/
+/*
+    The small objects that outlive a unit and are freed one at a 
+    time (the hash tables, their nodes, frames and heap objects) are 
+    carved out of slabs of objects of the same size class rather 
+    than each being malloced, so a store doesn't call malloc and 
+    a tables nodes end up next to each other.
+
+    Each thread has its own free list for each class so nothing is 
+    locked (something freed on another thread goes on its list). 
+    Slabs are never given back. Anything bigger than the biggest 
+    class is malloced.
+
+    \-slabs - prints how much of each class is used
+*/
+#define SLAB_SIZE 65536
+#define SLAB_CLASSES 6
+int slab_sizes[SLAB_CLASSES]={16,32,48,64,96,128}; // multiples of 16 so every object is aligned
+
+typedef struct SLAB_FREE_STRUCT
+{
+    struct SLAB_FREE_STRUCT* next;
+} SlabFree;
+
+typedef struct SLAB_STATS_STRUCT
+{
+    atomic_llong slabs;
+    atomic_llong used; // objects allocated and not freed
+    atomic_llong allocations;
+} SlabStats;
+SlabStats slab_stats[SLAB_CLASSES]; // atomic since every thread allocates
+__thread SlabFree* slab_free_lists[SLAB_CLASSES];
+
+static inline int slab_class(size_t size)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++){if (size <= slab_sizes[i]){return i;}}
+    return -1;
+}
+/* carves a new slab onto the threads free list for the class */
+void slab_refill(int class)
+{
+    char* slab = malloc(SLAB_SIZE);
+    int size = slab_sizes[class];
+    for (int offset = SLAB_SIZE - size; offset >= 0; offset -= size)
+    {
+        SlabFree* object = (SlabFree*)(slab + offset);
+        object->next = slab_free_lists[class];
+        slab_free_lists[class] = object;
+    }
+    atomic_fetch_add_explicit(&slab_stats[class].slabs, 1, memory_order_relaxed);
+}
+/* returns zeroed memory (like calloc) */
+void* slab_alloc(size_t size)
+{
+    int class = slab_class(size);
+    if (class == -1){return calloc(1, size);}
+    if (slab_free_lists[class] == NULL){slab_refill(class);}
+    SlabFree* object = slab_free_lists[class];
+    slab_free_lists[class] = object->next;
+    atomic_fetch_add_explicit(&slab_stats[class].used, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slab_stats[class].allocations, 1, memory_order_relaxed);
+    memset(object, 0, slab_sizes[class]);
+    return object;
+}
+/* size has to be what it was allocated with */
+void slab_free(void* memory, size_t size)
+{
+    int class = slab_class(size);
+    if (class == -1){free(memory);return;}
+    SlabFree* object = memory;
+    object->next = slab_free_lists[class];
+    slab_free_lists[class] = object;
+    atomic_fetch_sub_explicit(&slab_stats[class].used, 1, memory_order_relaxed);
+}
+void slabs_command(char** instructions,int instruction_length)
+{
+    if (instruction_length!=1){printf("Error: Invalid number of arguments for slabs command. Use 0 arguments.\n");return;}
+    for (int i = 0; i < SLAB_CLASSES; i++)
+    {
+        long long slabs=atomic_load(&slab_stats[i].slabs), used=atomic_load(&slab_stats[i].used);
+        long long capacity=slabs*(SLAB_SIZE/slab_sizes[i]);
+        printf("%4d bytes: %8lld used of %8lld (%6.2f%%) in %lld slabs, %lld allocations\n",slab_sizes[i],used,capacity,
+        capacity ? 100.0*used/capacity : 0.0,slabs,(long long)atomic_load(&slab_stats[i].allocations));
+    }
+}
+
+/***************************
+*       Symbol table       *
+***************************/
+/*
+    Every identifier, const and frame name is interned here once 
+    and then referred to by its id, so comparing names is comparing
+    ints and each name is only stored on the heap once.
+
+    Ids start at 1 (0 means no symbol).
+
+    The symbols are kept in pages that never move so that they can 
+    be read by id while other threads are interning (see eval_script). 
+    While symbol_threads is set the table is only changed under the 
+    symbol_lock and each thread caches the names it's interned so 
+    that most lookups don't need the lock.
+*/
+#define SYMBOL_PAGE_SIZE 4096
+#define MAX_SYMBOL_PAGES 65536
+#define SYMBOL_CACHE_SIZE 1024
+
+typedef struct SYMBOL_STRUCT
+{
+    char* name;
+    int length;
+    unsigned int hash;
+} SymbolType;
+
+SymbolType* symbol_pages[MAX_SYMBOL_PAGES]; // indexed by id (see symbol_at)
+int symbols_length=1;
+int* symbol_slots; // open addressing table of ids (0 for empty)
+int symbol_slots_size=0;
+#define symbol_at(id) (&symbol_pages[(id)/SYMBOL_PAGE_SIZE][(id)%SYMBOL_PAGE_SIZE])
+
+int symbol_threads=0;
+pthread_mutex_t symbol_lock=PTHREAD_MUTEX_INITIALIZER;
+typedef struct SYMBOL_CACHE_STRUCT
+{
+    char* name;
+    int length;
+    unsigned int hash;
+    int id;
+} SymbolCache;
+__thread SymbolCache symbol_cache[SYMBOL_CACHE_SIZE]; // ids are never removed so it never goes stale
+
+unsigned int symbol_hash(char* name, int length)
+{
+    unsigned int hash=2166136261u; // FNV-1a
+    for (int i = 0; i < length; i++){hash=(hash ^ (unsigned char)name[i]) * 16777619u;}
+    return hash;
+}
+/* finds the slot the name is in or should go in */
+int symbol_slot(char* name, int length, unsigned int hash)
+{
+    int mask=symbol_slots_size-1;
+    int slot=hash & mask;
+    while (symbol_slots[slot])
+    {
+        SymbolType* symbol=symbol_at(symbol_slots[slot]);
+        if (symbol->hash==hash && symbol->length==length && memcmp(symbol->name,name,length)==0){return slot;}
+        slot=(slot+1) & mask;
+    }
+    return slot;
+}
+/* returns the id of the name if it's been interned otherwise 0 */
+int symbol_lookup(char* name, int length)
+{
+    if (symbol_threads){pthread_mutex_lock(&symbol_lock);}
+    int id = symbol_slots_size ? symbol_slots[symbol_slot(name,length,symbol_hash(name,length))] : 0;
+    if (symbol_threads){pthread_mutex_unlock(&symbol_lock);}
+    return id;
+}
+/* symbol_intern without the lock */
+int symbol_insert(char* name, int length, unsigned int hash)
+{
+    // keep the table at most half full
+    if (symbols_length*2 >= symbol_slots_size)
+    {
+        symbol_slots_size = symbol_slots_size ? symbol_slots_size*2 : 256;
+        free(symbol_slots);
+        symbol_slots = calloc(symbol_slots_size, sizeof(int));
+        for (int id = 1; id < symbols_length; id++)
+        {symbol_slots[symbol_slot(symbol_at(id)->name,symbol_at(id)->length,symbol_at(id)->hash)]=id;}
+    }
+    int slot=symbol_slot(name,length,hash);
+    if (symbol_slots[slot]){return symbol_slots[slot];}
+    if (symbol_pages[symbols_length/SYMBOL_PAGE_SIZE]==NULL)
+    {
+        if (symbols_length/SYMBOL_PAGE_SIZE==MAX_SYMBOL_PAGES){printf("Error: Too many symbols\n");exit(1);}
+        symbol_pages[symbols_length/SYMBOL_PAGE_SIZE] = malloc(SYMBOL_PAGE_SIZE * sizeof(SymbolType));
+    }
+    SymbolType* symbol=symbol_at(symbols_length);
+    symbol->name = malloc((length + 1) * sizeof(char));
+    memcpy(symbol->name, name, length);
+    symbol->name[length] = '\0';
+    symbol->length = length;
+    symbol->hash = hash;
+    symbol_slots[slot] = symbols_length;
+    return symbols_length++;
+}
+/* returns the id of the name interning it if it's new */
+int symbol_intern(char* name, int length)
+{
+    unsigned int hash=symbol_hash(name,length);
+    if (!symbol_threads){return symbol_insert(name,length,hash);}
+    SymbolCache* cached=&symbol_cache[hash & (SYMBOL_CACHE_SIZE-1)];
+    if (cached->id && cached->hash==hash && cached->length==length && memcmp(cached->name,name,length)==0){return cached->id;}
+    pthread_mutex_lock(&symbol_lock);
+    int id=symbol_insert(name,length,hash);
+    pthread_mutex_unlock(&symbol_lock);
+    *cached=(SymbolCache){symbol_at(id)->name,length,hash,id};
+    return id;
+}
+char* symbol_name(int id){return symbol_at(id)->name;}
+
 typedef struct TOKEN_STRUCT
 {
     int type;
-    char* value;
+    int symbol; // interned id of ids and consts (0 otherwise)
+    char* value; // only set for literal values or once token_value copies the span out
+    char* source; // span into the lexers source (NULL if the token has no span)
+    int start;
+    int length;
 } TokenType;
+/*
+    A line (or more) of tokens stored as a struct of arrays so that 
+    they can be lexed in one go and gone through by index (see lex_into)
+*/
+typedef struct TOKEN_BUFFER_STRUCT
+{
+    int* types;
+    int* offsets; // where each token starts from the start of the input
+    int* lengths; // how many characters of the input each token is made from
+    int* symbols;
+    TokenType** tokens; // the tokens themselves (for the partial forms)
+    int count;
+    int capacity;
+    int cursor; // the next token for the parser
+    int unit; // changes whenever the buffer starts over (see token_buffer_clear)
+} TokenBuffer;
+__thread TokenBuffer unit_tokens; // the tokens of the current input unit (they're in the unit_arena)
 // lexer
+/*
+    The source is either a string, a memory mapped file, or a window 
+    of a stream that gets refilled as the lexer reaches the end of it
+    (everything from the marker on is kept so tokens can cross refills).
+*/
 typedef struct LEXER_STRUCT
 {
     char value;
     char* source;
     int index;
     int length;
+    int marker; // start of what's being collected
+    FILE* stream; // NULL unless the source is refilled from a stream
+    int capacity; // size of the streams window
+    int ended; // the stream has no more input
+    int owned; // the stream was opened by the lexer (closed by lexer_free)
+    int interactive; // the stream is a terminal so it's only refilled after a newline when more is asked for
+    int mapped; // the source is a memory mapped file
+    char* prompt; // printed before waiting on the stream for more input
+    int offset; // how much of the stream has been dropped from the start of the window
+    TokenBuffer* tokens; // what the parser takes tokens from
+    struct GRAMMAR_SNAPSHOT_STRUCT* grammar; // what it lexes and parses with (see grammar_acquire)
+    int borrowed; // the grammar is the units reference (see lexer_init)
+    int stale; // it ran an internal command so it moves onto the newest grammar at its next unit
 } LexerType;
 // function definitions
 int lexer_isrunning(LexerType* lexer);
@@ -26,27 +377,59 @@ char* char_to_string(LexerType* lexer);
 void lexer_next(LexerType* lexer);
 int compare_grammar(LexerType* lexer,char* compare);
 LexerType* lexer_init(char* source);
+LexerType* lexer_init_stream(FILE* stream);
+LexerType* lexer_init_file(char* path);
+int lexer_fill(LexerType* lexer, int count);
 TokenType* token_init(int type, char* value);
+TokenType* token_span(LexerType* lexer, int type, int start, int length);
+char* token_value(TokenType* token);
 TokenType* next_token(LexerType* lexer);
 TokenType* collect_token(LexerType* lexer);
 TokenType* collect_string(LexerType* lexer);
 TokenType* check_grammar(LexerType* lexer);
+int lex_into(LexerType* lexer, TokenBuffer* buffer);
+void token_buffer_clear(TokenBuffer* buffer);
+void dfa_dump(FILE* file);
+void lexer_refresh(LexerType* lexer);
 
 typedef struct FORM_STRUCT
 {
     int type;
     int frame;
     TokenType* partial_form[MAX_FORM_SIZE]; // tokens only
+    int first_token; // the range of the form in its lexers token buffer
+    int last_token;
     struct FORM_STRUCT* abstract_form; // evaluated prior to the form being evaluated
     char* message; // used for warnings and errors typically
 } FormType;
 
 FormType* form_init()
 {
-    FormType* form = calloc(1, sizeof(struct FORM_STRUCT));
+    FormType* form = arena_alloc(&unit_arena, sizeof(struct FORM_STRUCT));
     form->type = -1;
     return form;
 }
+/* 
+    A statement is evaluated as a postfix stream of form records (the 
+    abstract forms come right before the form they're in) rather than 
+    the FormType tree the parser matched it as (see next_statement)
+*/
+typedef struct FORM_RECORD_STRUCT
+{
+    int type;
+    int first_token; // the range of the form in its lexers token buffer
+    short tokens;
+    short children; // how many abstract forms come before it
+} FormRecord;
+
+typedef struct FORM_STREAM_STRUCT
+{
+    FormRecord* records;
+    int count;
+    int capacity;
+    struct GRAMMAR_SNAPSHOT_STRUCT* grammar; // the one the forms were matched with (held by the lexer)
+} FormStream;
+FormStream unit_forms; // the current statement
 /*
    gets the length of an array (won't work as expected if array decay occurs 
    e.g. when you pass in an array into a function it will only pass the 
@@ -82,6 +465,97 @@ char* char_as_string(char value)
     return str;
 }
 /***************************
+*    Matching automaton    *
+***************************/
+/*
+    A trie over a set of strings where each node has a transition for 
+    every character, so matching costs one array lookup per character 
+    no matter how many strings were added.
+
+    Once automaton_link has run the missing transitions are filled in 
+    from the failure links (Aho-Corasick), turning it into an automaton 
+    that finds the strings anywhere in the text rather than only at the 
+    start of it.
+*/
+typedef struct AUTOMATON_NODE_STRUCT
+{
+    int next[256]; // 0 (the root) when there's no transition
+    int fail; // longest proper suffix of this node that is also in the trie
+    int output; // closest node along the failure links that ends a string (-1 if none)
+    int match; // what ends at this node (-1 if nothing does)
+} AutomatonNode;
+
+typedef struct AUTOMATON_STRUCT
+{
+    AutomatonNode* nodes;
+    int length;
+    int capacity;
+} AutomatonType;
+
+int automaton_node(AutomatonType* automaton)
+{
+    if (automaton->length == automaton->capacity)
+    {
+        automaton->capacity = automaton->capacity ? automaton->capacity * 2 : 16;
+        automaton->nodes = realloc(automaton->nodes, automaton->capacity * sizeof(AutomatonNode));
+    }
+    AutomatonNode* node = &automaton->nodes[automaton->length];
+    memset(node, 0, sizeof(AutomatonNode));
+    node->output = -1;
+    node->match = -1;
+    return automaton->length++;
+}
+/* empties the automaton down to its root (keeps the memory for rebuilding) */
+void automaton_clear(AutomatonType* automaton)
+{
+    automaton->length = 0;
+    automaton_node(automaton);
+}
+/* 
+    adds a string that gives match when it's found (the first one added 
+    keeps the match for duplicates) and returns the node it ends on
+*/
+int automaton_add(AutomatonType* automaton, char* string, int match)
+{
+    int node = 0;
+    for (int i = 0; string[i]; i++)
+    {
+        unsigned char c = string[i];
+        int next = automaton->nodes[node].next[c];
+        if (next == 0){next = automaton_node(automaton);automaton->nodes[node].next[c] = next;}
+        node = next;
+    }
+    if (automaton->nodes[node].match == -1){automaton->nodes[node].match = match;}
+    return node;
+}
+/* computes the failure links breadth first and folds them into the transitions */
+void automaton_link(AutomatonType* automaton)
+{
+    int* queue = malloc(automaton->length * sizeof(int));
+    int head = 0, tail = 0;
+    AutomatonNode* nodes = automaton->nodes;
+    for (int c = 0; c < 256; c++){if (nodes[0].next[c]){queue[tail++] = nodes[0].next[c];}}
+    while (head < tail)
+    {
+        int node = queue[head++];
+        int fail = nodes[node].fail;
+        nodes[node].output = nodes[fail].match != -1 ? fail : nodes[fail].output;
+        for (int c = 0; c < 256; c++)
+        {
+            int next = nodes[node].next[c];
+            if (next){nodes[next].fail = nodes[fail].next[c];queue[tail++] = next;}
+            else{nodes[node].next[c] = nodes[fail].next[c];}
+        }
+    }
+    free(queue);
+}
+/* checks if the string ending on target has just been found at node (only after automaton_link) */
+int automaton_found(AutomatonType* automaton, int node, int target)
+{
+    for (; node != -1; node = automaton->nodes[node].output){if (node == target){return 1;}}
+    return 0;
+}
+/***************************
 * other Internal utilities *
 ***************************/
 /*
@@ -105,18 +579,35 @@ void help(char** instructions,int instruction_length)
         printf("%-10s - %s\n","grammar","prints the current grammar");
         printf("%-10s - %s\n","debug","enters debug mode");
         printf("%-10s - %s\n","view","views the current grammar");
-        printf("%-10s - %s\n","compile","compiles the current file");
+        printf("%-10s - %s\n","compile","compiles the evaluated statements into machine code (on, off or dump *file*)");
+        printf("%-10s - %s\n","lexer","tokenize with the dfa or hand lexer, or dump the dfa as a C table");
+        printf("%-10s - %s\n","parser","prints the parsers memo counters");
+        printf("%-10s - %s\n","eval","profiles the evaluators instructions and fuses the hottest ones (or turns the optimization passes on or off)");
+        printf("%-10s - %s\n","profile","times each phase, form and instruction (start, stop, reset or dump [file])");
+        printf("%-10s - %s\n","frames","prints the frames of the calls being made");
+        printf("%-10s - %s\n","gc","prints the garbage collectors stats (or collect, threshold, growth or step *n*)");
+        printf("%-10s - %s\n","slabs","prints how much of each slab size class is used");
         printf("%-10s - %s\n","exit","exits the program");
         printf("\n");
         return;
     }
     printf("Error: Invalid number of arguments for help command. Use 0 arguments.\n");
 }
+/* changes whenever the custom grammar does so that anything built from it knows to rebuild */
+int grammar_version=1;
+/* 1 when the lexer runs the DFA compiled from the grammar instead of the collectors (\-lexer dfa) */
+#ifdef DFA_TABLE
+int dfa_mode=1;
+#else
+int dfa_mode=0;
+#endif
+
 #define ASSIGN_GRAMMAR(index) \
 start_grammar[index]=start; \
 end_grammar[index]=end; \
 collect_grammar[index]=collect; \
 grammar_name[index]=name; \
+grammar_version++; \
 return;
 
 /* needs fixing for displaying the representation of the grammar i.e. end_grammar="\n" */
@@ -142,7 +633,8 @@ void add_grammar(char* start, char* end, int collect, char* name)
     int last_index=char_pointer_pointer_len(start_grammar);
     for (int i = 0; i < last_index; i++){if (strcmp(start_grammar[i],start)==0){ASSIGN_GRAMMAR(i)}}
     // allocate and assign
-    ASSIGN_GRAMMAR(last_index-1); // -1 because it returns after
+    if (last_index >= MAX_GRAMMAR_SIZE){printf("Error: The maximum number of grammars has been reached.\n");return;}
+    ASSIGN_GRAMMAR(last_index);
 }
 void remove_grammar(int index)
 {
@@ -159,6 +651,7 @@ void remove_grammar(int index)
     end_grammar[last_index]=NULL;
     collect_grammar[last_index]=-1;
     grammar_name[last_index]=NULL;   
+    grammar_version++;
 }
 
 void view_form()
@@ -173,9 +666,17 @@ void view_form()
         index++;
     }
 }
+/* changes whenever FORMS does so that the parsers form automaton knows to rebuild */
+int form_version=1;
+/* how often an abstract form was reused from the parsers memo (\-parser memo) */
+__thread int memo_hits=0; // per thread (eval_script adds its threads onto the main ones)
+__thread int memo_misses=0;
+
 #define ASSIGN_FORM(array,sequence) \
+memset(array[index], 0, sizeof(array[index])); \
+index2=0; \
 token = strtok(sequence, ","); \
-while (token != NULL) \
+while (token != NULL && index2 < MAX_FORM_SIZE-1) /* keeps a 0 on the end */ \
 { \
     array[index][index2]=atoi(token); \
     token = strtok(NULL, ","); \
@@ -187,7 +688,7 @@ void add_form(char token_sequence[],char* instruction_mapping)
     // find the last index
     int index=0;
     while (FORMS[index][0]!=0){index++;}
-    if (index < MAX_FORM_SIZE){printf("Error: The maximum number of forms has been reached.\n");return;}
+    if (index >= MAX_FORM_ITEMS-1){printf("Error: The maximum number of forms has been reached.\n");return;}
     FORMS[index+1][0]=0;
     EXEC_FORMS[index+1][0]=0;
     int index2=0;
@@ -195,27 +696,18 @@ void add_form(char token_sequence[],char* instruction_mapping)
     // convert the instruction sequence into a list of integers
     ASSIGN_FORM(FORMS,token_sequence);
     ASSIGN_FORM(EXEC_FORMS,instruction_mapping);
+    form_version++;
 }
 
-#define REMOVE_FORM(array,index) \
-while (FORMS[index][0]!=0) \
-{ \
-    index2=0; \
-    while (FORMS[index][index2]) \
-    { \
-        temp=FORMS[index+1][index2]; \
-        if (temp){FORMS[index][index2]=temp;} \
-        else{FORMS[index][index2]=-1;} \
-        index2++; \
-    } \
-    index++; \
-}
-
-void remove_form(int original_index)
+void remove_form(int index)
 {
-    int index2,temp;
-    REMOVE_FORM(FORMS,original_index)
-    REMOVE_FORM(EXEC_FORMS,original_index)
+    int length=0;
+    while (FORMS[length][0]!=0){length++;}
+    if (index < 0 || index >= length){printf("Error: There is no form at index %d.\n",index);return;}
+    // shifts the forms after it down (including the sentinel)
+    memmove(FORMS[index], FORMS[index+1], (length-index)*sizeof(FORMS[0]));
+    memmove(EXEC_FORMS[index], EXEC_FORMS[index+1], (length-index)*sizeof(EXEC_FORMS[0]));
+    form_version++;
 }
 void view_const(){int index=0;while (consts[index]){printf("%d: %s\n",index,consts[index]);index++;}}
 void add_const(char* constant)
@@ -223,10 +715,265 @@ void add_const(char* constant)
     int index=0;
     while (consts[index]){index++;}
     consts[index]=constant;
+    grammar_version++;
+}
+void remove_const(int index){while (consts[index]){consts[index]=consts[index+1];index++;}grammar_version++;}
+/***************************
+*    Grammar snapshots     *
+***************************/
+/*
+    The lexers and parsers never read the grammar arrays above, they 
+    read a GrammarSnapshot of them (with everything built from them) 
+    that is never changed once it's published.
+
+    Internal commands change the arrays one at a time (grammar_lock) 
+    and grammar_publish swaps in a new snapshot if they did. Lexers 
+    take a reference to the newest one without locking (grammar_acquire) 
+    and keep it, so many threads can lex while the grammar changes.
+
+    A replaced snapshot is retired and freed once it has no references 
+    left and no thread is between loading grammar_current and taking 
+    its reference (grammar_readers).
+*/
+#define FORM_TYPE_OFFSET 3 // TOKEN_LINE_CONTINUATION is the lowest token type
+#define FORM_TYPES (MAX_GRAMMAR_SIZE+FORM_TYPE_OFFSET)
+
+/* the dfa lexer (see build_dfa in lexer.c) */
+typedef struct DFA_STRUCT
+{
+    unsigned char classes[256]; // the class of each character
+    int class_count;
+    int length; // the number of states
+    int capacity;
+    unsigned short* next; // the state after state*class_count+class
+    unsigned char* action;
+    int* type; // the token type or grammar index
+    int* skip; // characters left off the start of the value (also marks a grammars body)
+    int* trim; // characters left off the end of the value
+    int* resume; // the body to carry on in if a longer start grammar doesn't match
+    int* escape; // the (up to) three characters that leave a body packed with DFA_ESCAPE (0 if it's not skipped through)
+    int fixed; // the tables are compiled in (DFA_TABLE)
+} DfaType;
+
+/* the forms trie (see build_form_automaton) */
+typedef struct FORM_AUTOMATON_STRUCT
+{
+    int classes[FORM_TYPES]; // the class of each token type
+    int class_count;
+    int length; // the number of nodes (0 is the root)
+    int* next; // the node after node*class_count+class (0 if there's no transition)
+    int* abstract; // the node after a nested form (0 if there isn't one)
+    int* match; // the form that ends on the node (-1 if none do)
+    int* last; // 1 if the form ending on the node can't be carried on
+} FormAutomatonType;
+
+typedef struct GRAMMAR_SNAPSHOT_STRUCT
+{
+    int version; // the grammar_version and form_version it's from
+    int form_version;
+    unsigned long long hash; // of the grammar and consts it's from (see grammar_hash)
+    atomic_int references;
+    struct GRAMMAR_SNAPSHOT_STRUCT* retired; // the next one waiting to be freed
+    /* the grammar */
+    char* start_grammar[MAX_GRAMMAR_SIZE];
+    char* end_grammar[MAX_GRAMMAR_SIZE];
+    int collect_grammar[MAX_GRAMMAR_SIZE];
+    unsigned char* consts; // 1 for the symbol ids that are consts
+    int consts_length;
+    int (*exec_forms)[MAX_FORM_SIZE];
+    /* built from it */
+    unsigned char char_class[256];
+    AutomatonType start_automaton;
+    AutomatonType end_automaton; // only built without SSE2 (see find_end)
+    int end_nodes[MAX_GRAMMAR_SIZE]; // the node in end_automaton that each grammars end finishes on
+    int end_lengths[MAX_GRAMMAR_SIZE];
+    DfaType dfa; // only built in dfa_mode (length is 0 otherwise so the lexers run the collectors)
+    FormAutomatonType forms;
+} GrammarSnapshot;
+
+_Atomic(GrammarSnapshot*) grammar_current;
+__thread GrammarSnapshot* unit_grammar; // the reference of the arena lexers (see lexer_init)
+atomic_int grammar_readers; // threads in grammar_acquire
+GrammarSnapshot* grammar_retired;
+pthread_mutex_t grammar_lock=PTHREAD_MUTEX_INITIALIZER; // held while the grammar is changed or published
+
+void build_grammar_automata(GrammarSnapshot* grammar);
+void build_dfa(DfaType* dfa, GrammarSnapshot* grammar);
+void dfa_free(DfaType* dfa);
+
+/*
+    FORMS is compiled into a trie keyed by token type (the snapshots forms) 
+    so that each token moves the matcher on with a single lookup no 
+    matter how many forms there are. It's built for each grammar snapshot 
+    (i.e. after add_form or remove_form).
+
+    Only the token types the forms use get a class (the rest are class 0 
+    which has no transitions) and ABSTRACT_FORM is an edge of its own that 
+    is taken by matching a nested form when the token has no transition.
+*/
+#define FORM_CLASS(type) ((type)+FORM_TYPE_OFFSET >= 0 && (type)+FORM_TYPE_OFFSET < FORM_TYPES ? automaton->classes[(type)+FORM_TYPE_OFFSET] : 0)
+
+void build_form_automaton(GrammarSnapshot* grammar)
+{
+    FormAutomatonType* automaton=&grammar->forms;
+    // the classes and the most nodes there can be
+    memset(automaton->classes, 0, sizeof(automaton->classes));
+    automaton->class_count=1;
+    int capacity=1;
+    for (int i = 0; FORMS[i][0]!=0; i++)
+    {
+        for (int j = 0; FORMS[i][j]; j++)
+        {
+            int type=FORMS[i][j]+FORM_TYPE_OFFSET;
+            if (FORMS[i][j]!=ABSTRACT_FORM && type >= 0 && type < FORM_TYPES && automaton->classes[type]==0){automaton->classes[type]=automaton->class_count++;}
+            capacity++;
+        }
+    }
+    automaton->next=calloc(capacity*automaton->class_count, sizeof(int));
+    automaton->abstract=calloc(capacity, sizeof(int));
+    automaton->match=malloc(capacity*sizeof(int));
+    automaton->last=calloc(capacity, sizeof(int));
+    for (int node = 0; node < capacity; node++){automaton->match[node]=-1;}
+    automaton->length=1;
+    for (int i = 0; FORMS[i][0]!=0; i++)
+    {
+        int node=0;
+        for (int j = 0; FORMS[i][j] && node!=-1; j++)
+        {
+            int* next;
+            if (FORMS[i][j]==ABSTRACT_FORM){next=&automaton->abstract[node];}
+            else if (FORM_CLASS(FORMS[i][j])){next=&automaton->next[node*automaton->class_count+FORM_CLASS(FORMS[i][j])];}
+            else{node=-1;break;} // not a token type so it can't be matched
+            if (*next==0){*next=automaton->length++;}
+            node=*next;
+        }
+        if (node > 0 && automaton->match[node]==-1){automaton->match[node]=i;} // the first one added keeps duplicates
+    }
+    for (int node = 0; node < automaton->length; node++)
+    {
+        if (automaton->match[node]==-1 || automaton->abstract[node]){continue;}
+        automaton->last[node]=1;
+        for (int k = 1; k < automaton->class_count; k++){if (automaton->next[node*automaton->class_count+k]){automaton->last[node]=0;break;}}
+    }
+}
+
+
+void grammar_free(GrammarSnapshot* grammar)
+{
+    free(grammar->start_automaton.nodes);
+    free(grammar->end_automaton.nodes);
+    dfa_free(&grammar->dfa);
+    free(grammar->forms.next);free(grammar->forms.abstract);free(grammar->forms.match);free(grammar->forms.last);
+    free(grammar->consts);
+    free(grammar->exec_forms);
+    free(grammar);
+}
+/* frees the retired snapshots that can't be read anymore (with the grammar_lock) */
+void grammar_reclaim()
+{
+    if (atomic_load(&grammar_readers)){return;} // they might've loaded one of them
+    GrammarSnapshot** retired=&grammar_retired;
+    while (*retired)
+    {
+        GrammarSnapshot* grammar=*retired;
+        if (atomic_load(&grammar->references)==0){*retired=grammar->retired;grammar_free(grammar);}
+        else{retired=&grammar->retired;}
+    }
+}
+/* FNV-1a */
+#define HASH_START 14695981039346656037ull
+unsigned long long hash_bytes(unsigned long long hash, void* data, int length)
+{
+    unsigned char* bytes=data;
+    for (int i = 0; i < length; i++){hash=(hash^bytes[i])*1099511628211ull;}
+    return hash;
+}
+#define HASH_STRING(value) hash=hash_bytes(hash, (value) ? (value) : "", (value) ? strlen(value)+1 : 1)
+/* 
+    a hash of the grammar and consts (rather than grammar_version which only 
+    counts the changes) so what's built from one grammar i.e. a dumped dfa 
+    is never used with another
+*/
+unsigned long long grammar_hash()
+{
+    unsigned long long hash=HASH_START;
+    for (int i = 0; i < len(start_grammar) && start_grammar[i]; i++)
+    {
+        HASH_STRING(start_grammar[i]);
+        HASH_STRING(end_grammar[i]);
+        hash=hash_bytes(hash, &collect_grammar[i], sizeof(int));
+    }
+    for (int i = 0; i < len(consts) && consts[i]; i++){HASH_STRING(consts[i]);}
+    return hash;
+}
+/* builds and swaps in a new snapshot if the grammar changed (with the grammar_lock) */
+void grammar_publish()
+{
+    GrammarSnapshot* current=atomic_load(&grammar_current);
+    if (current && current->version==grammar_version && current->form_version==form_version && (current->dfa.length > 0)==dfa_mode){return;}
+    GrammarSnapshot* grammar=calloc(1, sizeof(GrammarSnapshot));
+    grammar->version=grammar_version;
+    grammar->form_version=form_version;
+    grammar->hash=grammar_hash();
+    memcpy(grammar->start_grammar, start_grammar, sizeof(start_grammar));
+    memcpy(grammar->end_grammar, end_grammar, sizeof(end_grammar));
+    memcpy(grammar->collect_grammar, collect_grammar, sizeof(collect_grammar));
+    int ids[len(consts)], count=0, length=0;
+    for (int i = 0; i < len(consts) && consts[i]; i++)
+    {
+        ids[count]=symbol_intern(consts[i],strlen(consts[i]));
+        if (ids[count] >= length){length=ids[count]+1;}
+        count++;
+    }
+    grammar->consts=calloc(length ? length : 1, sizeof(unsigned char));
+    grammar->consts_length=length;
+    for (int i = 0; i < count; i++){grammar->consts[ids[i]]=1;}
+    int forms=0;
+    while (FORMS[forms][0]!=0){forms++;}
+    grammar->exec_forms=malloc((forms+1)*sizeof(EXEC_FORMS[0]));
+    memcpy(grammar->exec_forms, EXEC_FORMS, (forms+1)*sizeof(EXEC_FORMS[0]));
+    build_grammar_automata(grammar);
+    if (dfa_mode){build_dfa(&grammar->dfa,grammar);}
+    build_form_automaton(grammar);
+    atomic_store(&grammar->references, 1); // grammar_currents
+    GrammarSnapshot* old=atomic_exchange(&grammar_current, grammar);
+    if (old)
+    {
+        old->retired=grammar_retired;
+        grammar_retired=old;
+        atomic_fetch_sub(&old->references, 1);
+    }
+    grammar_reclaim();
+}
+/* returns a reference to the newest snapshot (without locking once there is one) */
+GrammarSnapshot* grammar_acquire()
+{
+    if (atomic_load(&grammar_current)==NULL)
+    {
+        pthread_mutex_lock(&grammar_lock);
+        grammar_publish();
+        pthread_mutex_unlock(&grammar_lock);
+    }
+    atomic_fetch_add(&grammar_readers, 1);
+    GrammarSnapshot* grammar=atomic_load(&grammar_current);
+    atomic_fetch_add(&grammar->references, 1);
+    atomic_fetch_sub(&grammar_readers, 1);
+    return grammar;
+}
+/* another reference to a snapshot that's already held */
+GrammarSnapshot* grammar_retain(GrammarSnapshot* grammar){atomic_fetch_add(&grammar->references, 1);return grammar;}
+void grammar_release(GrammarSnapshot* grammar)
+{
+    if (grammar==NULL){return;}
+    // the last reference frees it (or the next grammar_reclaim does if the grammar's being changed)
+    if (atomic_fetch_sub(&grammar->references, 1)==1 && pthread_mutex_trylock(&grammar_lock)==0)
+    {
+        grammar_reclaim();
+        pthread_mutex_unlock(&grammar_lock);
+    }
 }
-void remove_const(int index){while (consts[index]){consts[index]=consts[index+1];index++;}}
 #define HANDLE_ERROR else{printf("Error: Invalid arguments for grammar command.\n");}
-#define type(kind) strcmp(instructions[1],kind)==0
+#define type(index,kind) strcmp(instructions[index],kind)==0
 /* 
     For viewing and modifying the modifiable grammar
 */
@@ -241,35 +988,503 @@ void grammar(char** instructions,int instruction_length)
     if (instruction_length > 7){printf("Error: Invalid number of arguments for grammar command. Use 1-7 arguments.\n");return;}
     if (instruction_length==2)
     {
-        if (type("token")){view_grammar();}
-        else if(type("form")){view_form();}
-        else if(type("const")){view_const();}
+        if (type(1,"token")){view_grammar();}
+        else if(type(1,"form")){view_form();}
+        else if(type(1,"const")){view_const();}
         HANDLE_ERROR
     }
-    else if (instruction_length==7 && strcmp(instructions[1],"add")==0)
+    else if (instruction_length>=4 && strcmp(instructions[1],"add")==0)
     {
-        if (type("token")){add_grammar(instructions[3],instructions[4],atoi(instructions[5]),instructions[6]);}
-        else if(type("form")){add_form(instructions[3],instructions[4]);}
-        else if(type("const")){add_const(instructions[3]);}
+        if (instruction_length==7 && type(2,"token")){add_grammar(instructions[3],instructions[4],atoi(instructions[5]),instructions[6]);}
+        else if(instruction_length==5 && type(2,"form")){add_form(instructions[3],instructions[4]);}
+        else if(instruction_length==4 && type(2,"const")){add_const(instructions[3]);}
         HANDLE_ERROR
     }
-    else if (instruction_length==3 && strcmp(instructions[1],"remove")==0)
+    else if (instruction_length==4 && strcmp(instructions[1],"remove")==0)
     {
-        if (type("token")){remove_grammar(atoi(instructions[3]));}
-        else if(type("form")){remove_form(atoi(instructions[3]));}
-        else if(type("const")){remove_const(atoi(instructions[3]));}
+        if (type(2,"token")){remove_grammar(atoi(instructions[3]));}
+        else if(type(2,"form")){remove_form(atoi(instructions[3]));}
+        else if(type(2,"const")){remove_const(atoi(instructions[3]));}
         HANDLE_ERROR
     }
     /* for debugging */
     // for (int i = 0; i < custom_grammar_length; i++)
     // {printf("Start: %s,End: %s,Collect: %d,Name: %s\n",start_grammar[i],end_grammar[i],collect_grammar[i],grammar_name[i]);}
 }
+/*
+    picks how the source is tokenized:
+
+    \-lexer dfa         - runs the DFA compiled from the whole grammar
+    \-lexer hand        - runs the handwritten collectors (the default)
+    \-lexer dump *file* - writes the DFA out as a C table (see DFA_TABLE in lexer.c)
+*/
+void lexer_command(char** instructions,int instruction_length)
+{
+    if (instruction_length==2 && type(1,"dfa")){dfa_mode=1;}
+    else if (instruction_length==2 && type(1,"hand")){dfa_mode=0;}
+    else if (instruction_length==3 && type(1,"dump"))
+    {
+        FILE* file=fopen(instructions[2],"w");
+        if (file==NULL){printf("Error: Could not open the file '%s'\n",instructions[2]);return;}
+        dfa_dump(file);
+        fclose(file);
+    }
+    else{printf("Error: Invalid arguments for lexer command. Use dfa, hand or dump *file*.\n");}
+}
+/*
+    views the parsers internals:
+
+    \-parser memo       - prints how many abstract forms were reused from the memo
+    \-parser memo reset - sets the memo counters back to 0
+*/
+void parser_command(char** instructions,int instruction_length)
+{
+    if (instruction_length==2 && type(1,"memo")){printf("memo hits: %d, misses: %d\n",memo_hits,memo_misses);}
+    else if (instruction_length==3 && type(1,"memo") && type(2,"reset")){memo_hits=0;memo_misses=0;}
+    else{printf("Error: Invalid arguments for parser command. Use memo or memo reset.\n");}
+}
+/*****************************
+*    Optimization passes     *
+*****************************/
+/*
+    The passes compile_statement runs over each statement before 
+    it's fused (see optimize in evaluator.c) in this order:
+
+     - fold        BIN_OPs of two constants become a constant
+     - forward     a LOAD right after a STORE of the same id becomes a DUP
+     - dead_stores a STORE that's stored over (or deleted) before anything reads it or can fail is removed
+
+    \-eval passes              - prints which are on and how many instructions each has removed or rewritten
+    \-eval pass *name* on|off  - turns a pass on or off
+*/
+enum PASSES {PASS_FOLD, PASS_FORWARD, PASS_DEAD_STORES, PASS_COUNT};
+char* pass_names[]={"fold","forward","dead_stores",NULL};
+int passes[PASS_COUNT]={1,1,1};
+atomic_llong pass_removed[PASS_COUNT]; // eval_script compiles on more than one thread
+atomic_llong pass_rewritten[PASS_COUNT]; // replaced with another instruction (i.e. a LOAD forwarded into a DUP)
+
+void passes_print()
+{
+    for (int i = 0; i < PASS_COUNT; i++)
+    {
+        printf("%-12s %-3s %lld instructions removed, %lld rewritten\n",pass_names[i],passes[i] ? "on" : "off",
+        (long long)atomic_load(&pass_removed[i]),(long long)atomic_load(&pass_rewritten[i]));
+    }
+}
+/*****************************
+*     Superinstructions      *
+*****************************/
+/*
+    The opcodes the evaluator runs (see evaluator.c) and the
+    superinstructions it has, which are sequences of them fused
+    into one so that the sequence is only dispatched once.
+
+    The evaluator counts the pairs and triples of opcodes it runs
+    and after FUSE_AFTER statements the FUSE_LIMIT hottest sequences
+    (by dispatches saved) are the ones the compiler fuses from then on.
+
+    \-eval profile     - prints the counts and which superinstructions are used
+    \-eval fuse        - picks them from the counts now
+    \-eval fuse off    - stops fusing (and profiling)
+    \-eval reset       - profiles again from nothing
+    \-eval dump *file* - writes the ones used as a table to compile in with -DFUSE_TABLE='"file"'
+*/
+enum OPCODES
+{
+    OP_END,
+    OP_CONST,
+    OP_LOAD,
+    OP_STORE,
+    OP_BIN_OP,
+    OP_DELETE,
+    OP_EXT,
+    OP_DUP, // only made by the forward pass
+    // superinstructions
+    OP_LOAD_LOAD_BIN_OP,
+    OP_LOAD_CONST_BIN_OP,
+    OP_LOAD_BIN_OP_STORE,
+    OP_CONST_BIN_OP_STORE,
+    OP_LOAD_LOAD,
+    OP_LOAD_CONST,
+    OP_LOAD_BIN_OP,
+    OP_CONST_BIN_OP,
+    OP_BIN_OP_STORE,
+    OP_CONST_STORE,
+    OP_LOAD_EXT,
+    OP_BIN_OP_EXT,
+    OPCODE_COUNT
+};
+#define BASE_OPCODES OP_LOAD_LOAD_BIN_OP
+char* opcode_names[]={"END","CONST","LOAD","STORE","BIN_OP","DELETE","EXT","DUP",
+"LOAD_LOAD_BIN_OP","LOAD_CONST_BIN_OP","LOAD_BIN_OP_STORE","CONST_BIN_OP_STORE","LOAD_LOAD","LOAD_CONST",
+"LOAD_BIN_OP","CONST_BIN_OP","BIN_OP_STORE","CONST_STORE","LOAD_EXT","BIN_OP_EXT"};
+/* the superinstruction then the sequence it fuses (the longer ones come first so they're tried first) */
+int SUPERINSTRUCTIONS[][4]=
+{
+    {OP_LOAD_LOAD_BIN_OP,OP_LOAD,OP_LOAD,OP_BIN_OP},
+    {OP_LOAD_CONST_BIN_OP,OP_LOAD,OP_CONST,OP_BIN_OP},
+    {OP_LOAD_BIN_OP_STORE,OP_LOAD,OP_BIN_OP,OP_STORE},
+    {OP_CONST_BIN_OP_STORE,OP_CONST,OP_BIN_OP,OP_STORE},
+    {OP_LOAD_LOAD,OP_LOAD,OP_LOAD},
+    {OP_LOAD_CONST,OP_LOAD,OP_CONST},
+    {OP_LOAD_BIN_OP,OP_LOAD,OP_BIN_OP},
+    {OP_CONST_BIN_OP,OP_CONST,OP_BIN_OP},
+    {OP_BIN_OP_STORE,OP_BIN_OP,OP_STORE},
+    {OP_CONST_STORE,OP_CONST,OP_STORE},
+    {OP_LOAD_EXT,OP_LOAD,OP_EXT},
+    {OP_BIN_OP_EXT,OP_BIN_OP,OP_EXT},
+    {0} // sentinel
+};
+#define FUSE_AFTER 10000
+#define FUSE_LIMIT 4
+long long pair_counts[BASE_OPCODES][BASE_OPCODES];
+long long triple_counts[BASE_OPCODES][BASE_OPCODES][BASE_OPCODES];
+long long profiled=0; // how many statements were counted
+#ifdef FUSE_TABLE
+#include FUSE_TABLE // defines fused
+int fuse_profiling=0;
+#else
+int fused[OPCODE_COUNT]; // 1 for the superinstructions the compiler uses
+int fuse_profiling=1;
+#endif
+
+long long fuse_count(int* sequence)
+{
+    if (sequence[3]){return triple_counts[sequence[1]][sequence[2]][sequence[3]];}
+    return pair_counts[sequence[1]][sequence[2]];
+}
+/* picks the superinstructions that would've saved the most dispatches */
+void fuse_select()
+{
+    memset(fused, 0, sizeof(fused));
+    for (int n = 0; n < FUSE_LIMIT; n++)
+    {
+        int best=-1;
+        long long best_saved=0;
+        for (int i = 0; SUPERINSTRUCTIONS[i][0]; i++)
+        {
+            int* sequence=SUPERINSTRUCTIONS[i];
+            long long saved=fuse_count(sequence)*(sequence[3] ? 2 : 1);
+            if (!fused[sequence[0]] && saved > best_saved){best=i;best_saved=saved;}
+        }
+        if (best==-1){break;}
+        fused[SUPERINSTRUCTIONS[best][0]]=1;
+    }
+    fuse_profiling=0;
+}
+void fuse_print()
+{
+    printf("statements profiled: %lld\n",profiled);
+    for (int a = 1; a < BASE_OPCODES; a++)
+    {
+        for (int b = 1; b < BASE_OPCODES; b++)
+        {
+            if (pair_counts[a][b]){printf("%s %s: %lld\n",opcode_names[a],opcode_names[b],pair_counts[a][b]);}
+            for (int c = 1; c < BASE_OPCODES; c++)
+            {
+                if (triple_counts[a][b][c]){printf("%s %s %s: %lld\n",opcode_names[a],opcode_names[b],opcode_names[c],triple_counts[a][b][c]);}
+            }
+        }
+    }
+    printf("fused:");
+    for (int i = BASE_OPCODES; i < OPCODE_COUNT; i++){if (fused[i]){printf(" %s",opcode_names[i]);}}
+    printf("\n");
+}
+void eval_command(char** instructions,int instruction_length)
+{
+    if (instruction_length==2 && type(1,"profile")){fuse_print();}
+    else if (instruction_length==2 && type(1,"fuse")){fuse_select();}
+    else if (instruction_length==3 && type(1,"fuse") && type(2,"off")){memset(fused, 0, sizeof(fused));fuse_profiling=0;}
+    else if (instruction_length==2 && type(1,"reset"))
+    {
+        memset(pair_counts, 0, sizeof(pair_counts));
+        memset(triple_counts, 0, sizeof(triple_counts));
+        memset(fused, 0, sizeof(fused));
+        profiled=0;
+        fuse_profiling=1;
+    }
+    else if (instruction_length==2 && type(1,"passes")){passes_print();}
+    else if (instruction_length==4 && type(1,"pass") && (type(3,"on") || type(3,"off")))
+    {
+        int pass=0;
+        while (pass_names[pass] && strcmp(instructions[2],pass_names[pass])!=0){pass++;}
+        if (pass_names[pass]==NULL){printf("Error: There is no pass '%s'\n",instructions[2]);return;}
+        passes[pass]=type(3,"on");
+    }
+    else if (instruction_length==3 && type(1,"dump"))
+    {
+        FILE* file=fopen(instructions[2],"w");
+        if (file==NULL){printf("Error: Could not open the file '%s'\n",instructions[2]);return;}
+        fprintf(file,"/* superinstructions written by \\-eval dump */\n");
+        fprintf(file,"int fused[OPCODE_COUNT]={");
+        for (int i = BASE_OPCODES; i < OPCODE_COUNT; i++){if (fused[i]){fprintf(file,"[OP_%s]=1,",opcode_names[i]);}}
+        fprintf(file,"};\n");
+        fclose(file);
+    }
+    else{printf("Error: Invalid arguments for eval command. Use profile, fuse, fuse off, reset, passes, pass *name* on|off or dump *file*.\n");}
+}
+/*****************************
+*            JIT             *
+*****************************/
+/*
+    Statements are run as machine code (x86-64 Linux only) once the same 
+    sequence of opcodes has been evaluated JIT_THRESHOLD times, the 
+    machine code is made from a template for each instruction that's 
+    copied into executable memory and patched (see jit_compile in evaluator.c), 
+    CONST, DUP and BIN_OP (on ints) are done inline and the rest call their helper.
+
+    It's keyed by the opcodes alone (their operands are read from the 
+    statements code) so one is used by every statement of that shape, 
+    and a statement keeps its entry in its OP_END once it's looked up.
+
+    It's off by default since it isn't faster than the evaluator yet 
+    (statements are only evaluated once so looking them up costs as 
+    much as the dispatch it saves).
+
+    \-compile             - compiles every sequence evaluated so far (on the next statement)
+    \-compile on/off      - turns it on or off
+    \-compile dump *file* - writes the machine code of each one out in hex
+*/
+#define JIT_THRESHOLD 100
+#define JIT_CACHE_SIZE 4096 // a power of 2
+#define JIT_MEMORY (1 << 20)
+
+typedef struct JIT_ENTRY_STRUCT
+{
+    int* opcodes; // the sequence (superinstructions are written as what they fuse)
+    int length;
+    unsigned int hash;
+    int count; // how many times it's been evaluated
+    unsigned char* native; // NULL until it's compiled
+    int native_length;
+} JitEntry;
+JitEntry jit_cache[JIT_CACHE_SIZE];
+int jit_entries=0;
+unsigned char* jit_memory=NULL; // mapped on the first compile
+int jit_length=0;
+int jit_enabled=0; // \-compile on
+int jit_pending=0; // set by \-compile
+
+void jit_dump(FILE* file)
+{
+    for (int i = 0; i < JIT_CACHE_SIZE; i++)
+    {
+        JitEntry* entry=&jit_cache[i];
+        if (entry->native==NULL){continue;}
+        fprintf(file,"/*");
+        for (int j = 0; j < entry->length; j++){fprintf(file," %s",opcode_names[entry->opcodes[j]]);}
+        fprintf(file," (%d bytes, evaluated %d times) */\n",entry->native_length,entry->count);
+        for (int j = 0; j < entry->native_length; j++){fprintf(file,"%02x%s",entry->native[j],j%16==15 || j==entry->native_length-1 ? "\n" : " ");}
+    }
+}
 /*
     allows compiling sections of the program into machine code
 */
 void compile(char** instructions,int instruction_length)
 {
-    printf("To be implemented\n");
+    if (instruction_length==1){jit_pending=1;}
+    else if (instruction_length==2 && type(1,"on")){jit_enabled=1;}
+    else if (instruction_length==2 && type(1,"off")){jit_enabled=0;}
+    else if (instruction_length==3 && type(1,"dump"))
+    {
+        FILE* file=fopen(instructions[2],"w");
+        if (file==NULL){printf("Error: Could not open the file '%s'\n",instructions[2]);return;}
+        jit_dump(file);
+        fclose(file);
+    }
+    else{printf("Error: Invalid arguments for compile command. Use no arguments, on, off or dump *file*.\n");}
+}
+/*****************************
+*          Profiler          *
+*****************************/
+/*
+    Counts and times (in cycles from rdtsc or otherwise nanoseconds) 
+    each phase, each statement by the form it was parsed as and each 
+    instruction by its opcode (superinstructions are timed as what they 
+    fuse) while it's on. When it's off the only cost is checking profiling.
+
+    Evaluating while it's on goes one instruction at a time through the 
+    JIT helpers (see eval_profiled in evaluator.c) so each can be timed.
+
+    The forms counts are by index so they're cleared whenever the forms 
+    change (the indexes would be of the old ones).
+
+    \-profile start        - starts profiling
+    \-profile stop         - stops profiling
+    \-profile reset        - clears the counts
+    \-profile dump [file]  - prints the report (or writes it to the file) sorted by time
+*/
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_UNIT "cycles"
+static inline unsigned long long profile_clock(){return __rdtsc();}
+#else
+#define PROFILE_UNIT "ns"
+static inline unsigned long long profile_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ull+now.tv_nsec;
+}
+#endif
+enum PHASES {PHASE_LEX, PHASE_PARSE, PHASE_COMPILE, PHASE_EVAL, PHASE_COUNT};
+char* phase_names[]={"lex","parse","compile","eval"};
+
+typedef struct PROFILE_COUNT_STRUCT
+{
+    atomic_llong count;
+    atomic_llong cycles;
+} ProfileCount;
+int profiling=0;
+ProfileCount profile_phases[PHASE_COUNT]; // atomic since eval_script lexes and parses on threads
+ProfileCount profile_forms[MAX_FORM_ITEMS+1]; // the last one is for statements with no form
+int profile_form_version=0; // the form_version profile_forms are counts of
+ProfileCount profile_opcodes[BASE_OPCODES];
+__thread unsigned long long lex_cycles; // the threads lexing so far (the parser lexes as it goes)
+
+static inline void profile_add(ProfileCount* counter, unsigned long long cycles)
+{
+    atomic_fetch_add_explicit(&counter->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->cycles, cycles, memory_order_relaxed);
+}
+/* prints the counters that have counts from the most time to the least */
+void profile_section(FILE* file, char* title, ProfileCount* counters, int length, char* (*name)(int, char*))
+{
+    int* order=malloc(length*sizeof(int));
+    int count=0;
+    long long total=0;
+    for (int i = 0; i < length; i++)
+    {
+        if (atomic_load(&counters[i].count)==0){continue;}
+        long long cycles=atomic_load(&counters[i].cycles);
+        total+=cycles;
+        // insertion sort (there's only a handful)
+        int j=count++;
+        while (j > 0 && atomic_load(&counters[order[j-1]].cycles) < cycles){order[j]=order[j-1];j--;}
+        order[j]=i;
+    }
+    fprintf(file,"%s:\n",title);
+    char buffer[64];
+    for (int i = 0; i < count; i++)
+    {
+        ProfileCount* counter=&counters[order[i]];
+        long long cycles=atomic_load(&counter->cycles), times=atomic_load(&counter->count);
+        fprintf(file,"  %-24s %12lld times %16lld " PROFILE_UNIT " %6.2f%% %10.1f per time\n",
+        name(order[i],buffer),times,cycles,total ? 100.0*cycles/total : 0.0,(double)cycles/times);
+    }
+    free(order);
+}
+char* profile_phase_name(int phase, char* buffer){return phase_names[phase];}
+char* profile_opcode_name(int opcode, char* buffer){return opcode_names[opcode];}
+/* the forms counter (they're all cleared first if the forms have changed since the last count) */
+ProfileCount* profile_form(int form)
+{
+    if (profile_form_version!=form_version)
+    {
+        memset(profile_forms, 0, sizeof(profile_forms));
+        profile_form_version=form_version;
+    }
+    return &profile_forms[form];
+}
+char* profile_form_name(int form, char* buffer)
+{
+    if (form==MAX_FORM_ITEMS){return "none";}
+    int length=snprintf(buffer, 64, "form %d (", form);
+    for (int i = 0; i < MAX_FORM_SIZE && FORMS[form][i] && length < 56; i++){length+=snprintf(buffer+length, 64-length, i ? ",%d" : "%d", FORMS[form][i]);}
+    snprintf(buffer+length, 64-length, ")");
+    return buffer;
+}
+void profile_dump(FILE* file)
+{
+    profile_section(file,"phases",profile_phases,PHASE_COUNT,profile_phase_name);
+    profile_section(file,"forms",profile_form(0),MAX_FORM_ITEMS+1,profile_form_name); // (cleared if they're of old forms)
+    profile_section(file,"instructions",profile_opcodes,BASE_OPCODES,profile_opcode_name);
+}
+void profile_command(char** instructions,int instruction_length)
+{
+    if (instruction_length==2 && type(1,"start")){profiling=1;}
+    else if (instruction_length==2 && type(1,"stop")){profiling=0;}
+    else if (instruction_length==2 && type(1,"reset"))
+    {
+        memset(profile_phases, 0, sizeof(profile_phases));
+        memset(profile_forms, 0, sizeof(profile_forms));
+        memset(profile_opcodes, 0, sizeof(profile_opcodes));
+    }
+    else if (instruction_length==2 && type(1,"dump")){profile_dump(stdout);}
+    else if (instruction_length==3 && type(1,"dump"))
+    {
+        FILE* file=fopen(instructions[2],"w");
+        if (file==NULL){printf("Error: Could not open the file '%s'\n",instructions[2]);return;}
+        profile_dump(file);
+        fclose(file);
+    }
+    else{printf("Error: Invalid arguments for profile command. Use start, stop, reset or dump [file].\n");}
+}
+/*****************************
+*     Garbage collector      *
+*****************************/
+/*
+    Objects stored on the heap are put on a list and collected by 
+    marking what's reachable from the roots (the globals and the frame 
+    stack, which every frame is on) then sweeping the rest off the list 
+    (see gc_collect in memory.c).
+
+    It only runs at a safepoint between statements so the evaluators 
+    stack is empty and nothing but the roots can have an object. The 
+    mark is done at once (objects don't reference objects yet) and the 
+    sweep is done GC_SWEEP_STEP objects a statement after that.
+
+    A collection is started once what's been allocated since the last 
+    one is over the threshold or growth percent of what was live then.
+
+    \-gc                 - prints the collections, pause times and live bytes
+    \-gc collect         - collects at the next safepoint
+    \-gc threshold *n*   - collects after n bytes at least
+    \-gc growth *n*      - collects after n percent of the live bytes
+    \-gc step *n*        - sweeps n objects a statement
+*/
+#define GC_THRESHOLD (1<<20)
+#define GC_SWEEP_STEP 1024
+
+long long gc_threshold=GC_THRESHOLD;
+long long gc_growth=100;
+long long gc_step=GC_SWEEP_STEP;
+long long gc_allocated=0; // bytes since the last collection
+long long gc_live=0; // bytes on the heap list
+long long gc_marked=0; // bytes reached by the last mark
+long long gc_object_count=0;
+long long gc_collections=0;
+long long gc_freed=0; // bytes
+long long gc_pause_total=0, gc_pause_max=0; // in nanoseconds
+int gc_requested=0;
+int gc_sweeping=0;
+
+static inline long long gc_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ll+now.tv_nsec;
+}
+void gc_print()
+{
+    printf("collections: %lld\n",gc_collections);
+    printf("pause total: %.3f ms max: %.3f ms\n",gc_pause_total/1e6,gc_pause_max/1e6);
+    printf("live: %lld bytes in %lld objects (%lld marked)\n",gc_live,gc_object_count,gc_marked);
+    printf("freed: %lld bytes\n",gc_freed);
+    printf("threshold: %lld bytes growth: %lld%% step: %lld%s\n",gc_threshold,gc_growth,gc_step,gc_sweeping ? " (sweeping)" : "");
+}
+void gc_command(char** instructions,int instruction_length)
+{
+    long long* setting=NULL;
+    if (instruction_length==1){gc_print();return;}
+    if (instruction_length==2 && type(1,"collect")){gc_requested=1;return;}
+    if (instruction_length==3 && type(1,"threshold")){setting=&gc_threshold;}
+    else if (instruction_length==3 && type(1,"growth")){setting=&gc_growth;}
+    else if (instruction_length==3 && type(1,"step")){setting=&gc_step;}
+    if (setting==NULL){printf("Error: Invalid arguments for gc command. Use no arguments, collect, threshold *n*, growth *n* or step *n*.\n");return;}
+    char* end;
+    long long value=strtoll(instructions[2], &end, 10);
+    if (*end || value < 1){printf("Error: %s must be a positive integer\n",instructions[1]);return;}
+    *setting=value;
 }
 /* 
     exits the program
@@ -289,9 +1504,10 @@ void restart(char** instructions,int instruction_length)
     // stop all threads
     // clear everything from memory
 }
+void frames_command(char** instructions,int instruction_length); // (see Frame stack)
 /* user won't be able to modify these at run time */
-char* internals_keys[]={"?","grammar","compile","exit","restart"};
-void (*internals_values[])(char**, int) = {help,grammar,compile,exit_proxy,restart};
+char* internals_keys[]={"?","grammar","lexer","parser","eval","compile","profile","frames","gc","slabs","exit","restart"};
+void (*internals_values[])(char**, int) = {help,grammar,lexer_command,parser_command,eval_command,compile,profile_command,frames_command,gc_command,slabs_command,exit_proxy,restart};
 // this is arbitary, it depends on how many args you want
 #define MAX_COMMAND_ARGS 10
 /* 
@@ -365,17 +1581,27 @@ void command_parse(char* instructions,char* keys[],void (*values[])(char**, int)
 typedef struct node
 {
     char* key;
-    void* value;
+    int symbol; // the keys interned id
+    union
+    {
+        void* value;
+        uint64_t data; // a Value (see memory.c)
+    };
     struct node* next;
 } Node;
 
 // there might be better ways of doing this but a struct will do for now if I really want a HashTable type
-typedef struct HASHTABLE_STRUCT {Node** table;} HashTable;
+typedef struct HASHTABLE_STRUCT
+{
+    Node** table;
+    unsigned int version; // changes whenever a node is added or removed (see InlineCache in memory.c)
+} HashTable;
 
 HashTable* table_init()
 {
-    HashTable* table = calloc(1, sizeof(HashTable));
+    HashTable* table = slab_alloc(sizeof(HashTable));
     table->table = calloc(TABLE_SIZE, sizeof(Node*));
+    table->version = 1; // so an empty cache never matches
     return table;
 }
 
@@ -396,47 +1622,48 @@ HashTable* table_init()
     Therefore, typically it's said that on average a hash table
     is roughly constant time (if no collisions) or linear (if 
     there is e.g. it will traverse a linked list of the keys
-    and do a string compare to figure out which node has the value).
+    and compare them to figure out which node has the value).
+
+    The keys are interned in the symbol table so the hash is 
+    just the keys id and comparing keys is comparing ids.
 */
 
-int hash(char* key)
-{
-    int hash=0;
-    for (int i = 0; i < strlen(key); i++) {hash+=key[i];}
-    return hash % TABLE_SIZE;
-}
+int hash(int symbol){return symbol % TABLE_SIZE;}
 
-void table_set(HashTable* table, char* key, void* value)
+void table_set_symbol(HashTable* table, int symbol, void* value)
 {
-    Node* node=calloc(1, sizeof(Node*));
-    node->key=key;
+    Node* node=slab_alloc(sizeof(Node));
+    node->key=symbol_name(symbol);
+    node->symbol=symbol;
     node->value=value;
-    int index=hash(key);
+    int index=hash(symbol);
     /* make them point to each other */
     node->next=table->table[index];
     table->table[index]=node;
+    table->version++;
 }
 
-void* table_get(HashTable* table, char* key)
+void* table_get_symbol(HashTable* table, int symbol)
 {
-    Node* node=table->table[hash(key)];
+    Node* node=table->table[hash(symbol)];
     while (node != NULL) {
-        if (strcmp(node->key, key) == 0){return node->value;}
+        if (node->symbol == symbol){return node->value;}
         node=node->next;
     }
     return NULL;
 }
 
-void table_delete(HashTable* table, char* key)
+void table_delete_symbol(HashTable* table, int symbol)
 {
-    int index=hash(key);
+    int index=hash(symbol);
     Node* node=table->table[index];
     Node* prev=NULL;
     while (node != NULL) {
-        if (strcmp(node->key, key) == 0) {
+        if (node->symbol == symbol) {
             if (prev == NULL) {table->table[index] = node->next;} 
             else {prev->next=node->next;}
-            free(node);
+            slab_free(node, sizeof(Node));
+            table->version++;
             return;
         }
         prev=node;
@@ -444,16 +1671,76 @@ void table_delete(HashTable* table, char* key)
     }
 }
 
-void free_table(HashTable* table)
+void table_set(HashTable* table, char* key, void* value){table_set_symbol(table, symbol_intern(key, strlen(key)), value);}
+/* keys that were never interned can't be in any table */
+void* table_get(HashTable* table, char* key)
+{
+    int symbol=symbol_lookup(key, strlen(key));
+    return symbol ? table_get_symbol(table, symbol) : NULL;
+}
+void table_delete(HashTable* table, char* key)
+{
+    int symbol=symbol_lookup(key, strlen(key));
+    if (symbol){table_delete_symbol(table, symbol);}
+}
+
+/* frees the nodes but keeps the table */
+void table_clear(HashTable* table)
 {
     for (int i = 0; i < TABLE_SIZE; i++) {
         Node* node = table->table[i];
         while (node != NULL) {
             Node* next = node->next;
-            free(node);
+            slab_free(node, sizeof(Node));
             node = next;
         }
+        table->table[i] = NULL;
     }
+    table->version++;
+}
+void free_table(HashTable* table)
+{
+    table_clear(table);
     free(table->table);
-    free(table);
+    slab_free(table, sizeof(HashTable));
+}
+
+/***********************
+*     Frame stack      *
+***********************/
+/*
+    The frames of the calls being made are on a stack rather than 
+    each being allocated and put into the globals. A frames locals 
+    are slots on the slot stack that were numbered when the function 
+    was compiled (see LocalScope in memory.c) and only the ones 
+    looked up by name at run time go in a table (made the first time 
+    one is and kept for the next frame at that depth).
+
+    \-frames - prints the frames on the stack (the innermost first)
+*/
+#define FRAME_STACK_SIZE 1024
+#define SLOT_STACK_SIZE 65536
+
+typedef struct CALL_FRAME_STRUCT
+{
+    int symbol; // the functions name
+    uint64_t* slots; // its locals (Values, see memory.c)
+    int slot_count;
+    HashTable* dynamic; // the locals that weren't given slots
+    int dynamic_count;
+} CallFrame;
+CallFrame frame_stack[FRAME_STACK_SIZE];
+int frame_depth=0;
+uint64_t slot_stack[SLOT_STACK_SIZE];
+int slot_top=0;
+
+void frames_command(char** instructions,int instruction_length)
+{
+    if (instruction_length!=1){printf("Error: Invalid number of arguments for frames command. Use 0 arguments.\n");return;}
+    if (frame_depth==0){printf("There are no frames\n");return;}
+    for (int i = frame_depth-1; i >= 0; i--)
+    {
+        CallFrame* frame=&frame_stack[i];
+        printf("#%d %s (%d slots, %d by name)\n",i,symbol_name(frame->symbol),frame->slot_count,frame->dynamic_count);
+    }
 }